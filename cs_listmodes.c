@@ -8,17 +8,45 @@
 
 #include <atheme.h>
 
-static const char *
-channel_modes_restricted(struct sourceinfo *const restrict si, const struct channel *const restrict c)
+#define LISTMODES_PRIVDATA "cs_listmodes:modes"
+
+// Rendered mode strings of a registered channel, dropped whenever its modes change
+struct listmodes_cache
+{
+	unsigned int    modes;
+	bool            key;
+	unsigned int    limit;
+	char *          rendered[2];    // indexed by whether oper-only modes are shown; NULL until needed
+};
+
+static void
+listmodes_cache_free(struct listmodes_cache *const restrict cache)
+{
+	(void) free(cache->rendered[0]);
+	(void) free(cache->rendered[1]);
+	(void) free(cache);
+}
+
+static void
+listmodes_invalidate(struct mychan *const restrict mc)
 {
-	static char result[BUFSIZE];
+	struct listmodes_cache *cache;
+
+	if (mc && (cache = privatedata_delete(mc, LISTMODES_PRIVDATA)))
+		(void) listmodes_cache_free(cache);
+}
+
+static char *
+channel_modes_render(const struct channel *const restrict c, const bool show_oper)
+{
+	char result[BUFSIZE];
 	char *p = result;
 
 	*p++ = '+';
 
 	for (size_t i = 0; mode_list[i].mode != '\0'; i++)
 	{
-		if ((ircd->oper_only_modes & mode_list[i].value) && ! has_priv(si, PRIV_CHAN_CMODES))
+		if ((ircd->oper_only_modes & mode_list[i].value) && ! show_oper)
 			continue;
 
 		if (c->modes & mode_list[i].value)
@@ -37,7 +65,350 @@ channel_modes_restricted(struct sourceinfo *const restrict si, const struct chan
 
 	*p++ = 0x00;
 
-	return result;
+	return sstrdup(result);
+}
+
+static const char *
+channel_modes_restricted(struct mychan *const restrict mc, const bool show_oper)
+{
+	const struct channel *const c = mc->chan;
+	struct listmodes_cache *cache = privatedata_get(mc, LISTMODES_PRIVDATA);
+
+	// Not every protocol module runs the channel_mode hook when modes are reset on a TS change
+	if (cache && (cache->modes != c->modes || cache->key != (c->key != NULL) || cache->limit != c->limit))
+	{
+		(void) listmodes_invalidate(mc);
+		cache = NULL;
+	}
+
+	if (! cache)
+	{
+		cache = smalloc(sizeof *cache);
+		cache->modes = c->modes;
+		cache->key = (c->key != NULL);
+		cache->limit = c->limit;
+
+		(void) privatedata_set(mc, LISTMODES_PRIVDATA, cache);
+	}
+
+	// Both renderings are the same if the ircd has no oper-only modes
+	const size_t idx = (show_oper && ircd->oper_only_modes) ? 1 : 0;
+
+	if (! cache->rendered[idx])
+		cache->rendered[idx] = channel_modes_render(c, show_oper);
+
+	return cache->rendered[idx];
+}
+
+static void
+listmodes_channel_mode(struct hook_channel_mode *const restrict hdata)
+{
+	(void) listmodes_invalidate(mychan_from(hdata->c));
+}
+
+static void
+listmodes_channel_change(struct channel *const restrict c)
+{
+	(void) listmodes_invalidate(mychan_from(c));
+}
+
+static void
+listmodes_channel_drop(struct mychan *const restrict mc)
+{
+	(void) listmodes_invalidate(mc);
+}
+
+enum listmodes_sort
+{
+	LISTMODES_SORT_NONE = 0,
+	LISTMODES_SORT_NAME,
+	LISTMODES_SORT_MODES,
+};
+
+struct listmodes_filter
+{
+	const char *            glob;
+	unsigned int            modes_on;
+	unsigned int            modes_off;
+	bool                    key_on;
+	bool                    key_off;
+	bool                    limit_on;
+	bool                    limit_off;
+	bool                    mlockdiff;
+	enum listmodes_sort     sort;
+	unsigned int            from;       // 1-based
+	unsigned int            limit;      // 0 for no limit
+	const char *            account;    // list channels of this account instead of the caller's
+	bool                    summary;
+};
+
+struct listmodes_row
+{
+	struct mychan *         mc;
+	const char *            cmodes;     // only filled in before sorting by modes
+};
+
+static bool
+listmodes_parse_modes(struct listmodes_filter *const restrict filter, const char *const restrict arg,
+                      const bool show_oper)
+{
+	bool on = true;
+
+	for (const char *p = arg; *p != '\0'; p++)
+	{
+		if (*p == '+' || *p == '-')
+		{
+			on = (*p == '+');
+			continue;
+		}
+
+		if (*p == 'k')
+		{
+			*(on ? &filter->key_on : &filter->key_off) = true;
+			continue;
+		}
+
+		if (*p == 'l')
+		{
+			*(on ? &filter->limit_on : &filter->limit_off) = true;
+			continue;
+		}
+
+		size_t i;
+
+		for (i = 0; mode_list[i].mode != '\0'; i++)
+			if (mode_list[i].mode == *p)
+				break;
+
+		// Oper-only modes are rejected like unknown ones, so that filtering can't reveal them
+		if (mode_list[i].mode == '\0' || ((ircd->oper_only_modes & mode_list[i].value) && ! show_oper))
+			return false;
+
+		*(on ? &filter->modes_on : &filter->modes_off) |= mode_list[i].value;
+	}
+
+	return true;
+}
+
+/* Whether the current modes of a channel differ from what its MLOCK enforces. Oper-only
+ * modes are left out unless they are shown, as they would otherwise give away hidden state.
+ */
+static bool
+listmodes_mlock_differs(const struct mychan *const restrict mc, const bool show_oper)
+{
+	const struct channel *const c = mc->chan;
+	const unsigned int visible = show_oper ? ~0U : ~ircd->oper_only_modes;
+
+	if (((mc->mlock_on & ~c->modes) | (mc->mlock_off & c->modes)) & visible)
+		return true;
+
+	if (mc->mlock_limit && c->limit != mc->mlock_limit)
+		return true;
+
+	if ((mc->mlock_off & CMODE_LIMIT) && c->limit)
+		return true;
+
+	if (mc->mlock_key && (! c->key || strcmp(c->key, mc->mlock_key) != 0))
+		return true;
+
+	if ((mc->mlock_off & CMODE_KEY) && c->key)
+		return true;
+
+	return false;
+}
+
+// Runs on raw channel state only; nothing is formatted for channels that don't match
+static bool
+listmodes_filter_match(const struct listmodes_filter *const restrict filter, const struct mychan *const restrict mc,
+                       const bool show_oper)
+{
+	const struct channel *const c = mc->chan;
+
+	if (filter->glob && match(filter->glob, mc->name) != 0)
+		return false;
+
+	// Empty channels have no modes to match against
+	if (! c)
+		return ! (filter->modes_on || filter->key_on || filter->limit_on || filter->mlockdiff);
+
+	if ((c->modes & filter->modes_on) != filter->modes_on || (c->modes & filter->modes_off))
+		return false;
+
+	if ((filter->key_on && ! c->key) || (filter->key_off && c->key))
+		return false;
+
+	if ((filter->limit_on && ! c->limit) || (filter->limit_off && c->limit))
+		return false;
+
+	if (filter->mlockdiff && ! listmodes_mlock_differs(mc, show_oper))
+		return false;
+
+	return true;
+}
+
+static int
+listmodes_cmp_name(const void *const a, const void *const b)
+{
+	const struct listmodes_row *const ra = a;
+	const struct listmodes_row *const rb = b;
+
+	return irccasecmp(ra->mc->name, rb->mc->name);
+}
+
+static int
+listmodes_cmp_modes(const void *const a, const void *const b)
+{
+	const struct listmodes_row *const ra = a;
+	const struct listmodes_row *const rb = b;
+	const int ret = strcmp(ra->cmodes, rb->cmodes);
+
+	return ret ? ret : listmodes_cmp_name(a, b);
+}
+
+static const char *
+listmodes_row_modes(struct listmodes_row *const restrict row, const bool show_oper)
+{
+	if (! row->cmodes)
+		row->cmodes = row->mc->chan ? channel_modes_restricted(row->mc, show_oper) : _("<channel empty>");
+
+	return row->cmodes;
+}
+
+static bool
+listmodes_parse_args(struct sourceinfo *const restrict si, struct listmodes_filter *const restrict filter,
+                     const int parc, char **const restrict parv, const bool show_oper)
+{
+	for (int i = 0; i < parc && parv[i]; i++)
+	{
+		const char *const arg = parv[i];
+
+		if (*arg == '+' || *arg == '-')
+		{
+			if (! listmodes_parse_modes(filter, arg, show_oper))
+			{
+				(void) command_fail(si, fault_badparams, _("Invalid mode filter \2%s\2."), arg);
+				return false;
+			}
+		}
+		else if (strcasecmp(arg, "MLOCKDIFF") == 0)
+			filter->mlockdiff = true;
+		else if (strcasecmp(arg, "SUMMARY") == 0)
+			filter->summary = true;
+		else if (strcasecmp(arg, "ACCOUNT") == 0 && i + 1 < parc && parv[i + 1])
+			filter->account = parv[++i];
+		else if (strcasecmp(arg, "SORT") == 0 && i + 1 < parc && parv[i + 1])
+		{
+			const char *const key = parv[++i];
+
+			if (strcasecmp(key, "NAME") == 0)
+				filter->sort = LISTMODES_SORT_NAME;
+			else if (strcasecmp(key, "MODES") == 0)
+				filter->sort = LISTMODES_SORT_MODES;
+			else
+			{
+				(void) command_fail(si, fault_badparams, _("Invalid sort order \2%s\2."), key);
+				return false;
+			}
+		}
+		else if ((strcasecmp(arg, "LIMIT") == 0 || strcasecmp(arg, "FROM") == 0) && i + 1 < parc && parv[i + 1])
+		{
+			unsigned int *const value = (strcasecmp(arg, "LIMIT") == 0) ? &filter->limit : &filter->from;
+
+			if (! string_to_uint(parv[++i], value) || ! *value)
+			{
+				(void) command_fail(si, fault_badparams, _("\2%s\2 must be a positive number."), arg);
+				return false;
+			}
+		}
+		else if (! filter->glob)
+			filter->glob = arg;
+		else
+		{
+			(void) command_fail(si, fault_badparams, STR_INVALID_PARAMS, "LISTMODES");
+			(void) command_fail(si, fault_badparams, _("Syntax: LISTMODES [ACCOUNT <account>] [pattern] "
+			                                           "[+modes|-modes] [MLOCKDIFF] [SUMMARY] "
+			                                           "[SORT NAME|MODES] [LIMIT n] [FROM n]"));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// One line per mode instead of one per channel; counts come straight from channel and MLOCK state
+static void
+listmodes_summary(struct sourceinfo *const restrict si, const struct listmodes_row *const restrict rows,
+                  const unsigned int chancount, const bool show_oper)
+{
+	size_t nmodes = 0;
+
+	while (mode_list[nmodes].mode != '\0')
+		nmodes++;
+
+	// The simple modes, followed by +k and +l
+	unsigned int *const set = smalloc((nmodes + 2) * sizeof *set);
+	unsigned int *const lock_on = smalloc((nmodes + 2) * sizeof *lock_on);
+	unsigned int *const lock_off = smalloc((nmodes + 2) * sizeof *lock_off);
+	unsigned int empty = 0;
+	unsigned int differs = 0;
+
+	for (unsigned int i = 0; i < chancount; i++)
+	{
+		const struct mychan *const mc = rows[i].mc;
+		const struct channel *const c = mc->chan;
+
+		for (size_t m = 0; m < nmodes; m++)
+		{
+			if (c && (c->modes & mode_list[m].value))
+				set[m]++;
+			if (mc->mlock_on & mode_list[m].value)
+				lock_on[m]++;
+			if (mc->mlock_off & mode_list[m].value)
+				lock_off[m]++;
+		}
+
+		if (c && c->key)
+			set[nmodes]++;
+		if (mc->mlock_key)
+			lock_on[nmodes]++;
+		if (mc->mlock_off & CMODE_KEY)
+			lock_off[nmodes]++;
+
+		if (c && c->limit)
+			set[nmodes + 1]++;
+		if (mc->mlock_limit)
+			lock_on[nmodes + 1]++;
+		if (mc->mlock_off & CMODE_LIMIT)
+			lock_off[nmodes + 1]++;
+
+		if (! c)
+			empty++;
+		else if (listmodes_mlock_differs(mc, show_oper))
+			differs++;
+	}
+
+	(void) command_success_nodata(si, _("%-6s %-8s %-10s %s"), _("Mode"), _("Set"), _("MLOCK on"), _("MLOCK off"));
+
+	for (size_t m = 0; m < nmodes + 2; m++)
+	{
+		const char mode = (m == nmodes) ? 'k' : (m == nmodes + 1) ? 'l' : mode_list[m].mode;
+
+		if (m < nmodes && (ircd->oper_only_modes & mode_list[m].value) && ! show_oper)
+			continue;
+
+		if (! set[m] && ! lock_on[m] && ! lock_off[m])
+			continue;
+
+		(void) command_success_nodata(si, "+%-5c %-8u %-10u %u", mode, set[m], lock_on[m], lock_off[m]);
+	}
+
+	(void) command_success_nodata(si, " ");
+	(void) command_success_nodata(si, _("\2%u\2 channels, \2%u\2 empty, \2%u\2 with modes differing from their "
+	                                    "MLOCK."), chancount, empty, differs);
+
+	(void) free(set);
+	(void) free(lock_on);
+	(void) free(lock_off);
 }
 
 static void
@@ -46,7 +417,40 @@ cs_cmd_listmodes_fn(struct sourceinfo *si, int parc, char *parv[])
 	const mowgli_node_t *n;
 	unsigned int chancount = 0;
 
-	MOWGLI_ITER_FOREACH(n, entity(si->smu)->chanacs.head)
+	// Checked once here rather than for every mode of every channel
+	const bool show_oper = has_priv(si, PRIV_CHAN_CMODES);
+
+	struct listmodes_filter filter = {
+		.from           = 1,
+	};
+
+	if (! listmodes_parse_args(si, &filter, parc, parv, show_oper))
+		return;
+
+	struct myuser *mu = si->smu;
+
+	if (filter.account)
+	{
+		if (! has_priv(si, PRIV_CHAN_AUSPEX))
+		{
+			(void) command_fail(si, fault_noprivs, STR_NOT_AUTHORIZED);
+			return;
+		}
+
+		if (! (mu = myuser_find_ext(filter.account)))
+		{
+			(void) command_fail(si, fault_nosuch_target, STR_IS_NOT_REGISTERED, filter.account);
+			return;
+		}
+	}
+
+	const bool filtered = filter.glob || filter.modes_on || filter.modes_off || filter.key_on || filter.key_off ||
+	                      filter.limit_on || filter.limit_off || filter.mlockdiff;
+
+	mowgli_list_t *const chanacs = &entity(mu)->chanacs;
+	struct listmodes_row *const rows = smalloc((MOWGLI_LIST_LENGTH(chanacs) + 1) * sizeof *rows);
+
+	MOWGLI_ITER_FOREACH(n, chanacs->head)
 	{
 		const struct chanacs *const ca = n->data;
 
@@ -57,34 +461,88 @@ cs_cmd_listmodes_fn(struct sourceinfo *si, int parc, char *parv[])
 
 		continue_if_fail(mc != NULL);
 
-		const char *const cmodes = mc->chan ? channel_modes_restricted(si, mc->chan) : _("<channel empty>");
+		if (! listmodes_filter_match(&filter, mc, show_oper))
+			continue;
 
-		if (! chancount)
-			(void) command_success_nodata(si, _("%-32s %-16s %s"), _("Channel"), _("Modes"), _("MLOCK"));
+		rows[chancount++] = (struct listmodes_row) { .mc = mc };
+	}
+
+	if (filter.summary)
+	{
+		if (chancount)
+			(void) listmodes_summary(si, rows, chancount, show_oper);
+		else
+			(void) command_success_nodata(si, _("No channels matched."));
+
+		(void) free(rows);
+		(void) logcommand(si, (mu != si->smu) ? CMDLOG_ADMIN : CMDLOG_GET, "LISTMODES:SUMMARY: \2%s\2 "
+		                  "(\2%u\2 channels)", entity(mu)->name, chancount);
+		return;
+	}
+
+	if (filter.sort == LISTMODES_SORT_MODES)
+		for (unsigned int i = 0; i < chancount; i++)
+			(void) listmodes_row_modes(&rows[i], show_oper);
+
+	if (filter.sort == LISTMODES_SORT_NAME)
+		(void) qsort(rows, chancount, sizeof *rows, &listmodes_cmp_name);
+	else if (filter.sort == LISTMODES_SORT_MODES)
+		(void) qsort(rows, chancount, sizeof *rows, &listmodes_cmp_modes);
 
-		(void) command_success_nodata(si, _("%-32s %-16s %s"), mc->name, cmodes, mychan_get_mlock(mc));
+	const unsigned int first = filter.from - 1;
+	unsigned int last = chancount;
 
-		chancount++;
+	if (filter.limit && first < chancount && chancount - first > filter.limit)
+		last = first + filter.limit;
+
+	for (unsigned int i = first; i < last; i++)
+	{
+		struct mychan *const mc = rows[i].mc;
+
+		if (i == first)
+			(void) command_success_nodata(si, _("%-32s %-16s %s"), _("Channel"), _("Modes"), _("MLOCK"));
+
+		(void) command_success_nodata(si, _("%-32s %-16s %s"), mc->name, listmodes_row_modes(&rows[i], show_oper),
+		                              mychan_get_mlock(mc));
 	}
 
-	if (chancount)
+	(void) free(rows);
+
+	if (chancount && first < chancount)
 	{
 		(void) command_success_nodata(si, " ");
-		(void) command_success_nodata(si, ngettext(N_("\2%u\2 channel returned."),
-		                                           N_("\2%u\2 channels returned."),
-		                                           chancount), chancount);
+
+		if (first || last < chancount)
+			(void) command_success_nodata(si, _("Showing channels \2%u\2-\2%u\2 of \2%u\2."),
+			                              first + 1, last, chancount);
+		else
+			(void) command_success_nodata(si, ngettext(N_("\2%u\2 channel returned."),
+			                                           N_("\2%u\2 channels returned."),
+			                                           chancount), chancount);
 	}
+	else if (chancount)
+		(void) command_success_nodata(si, _("FROM \2%u\2 is past the end of the result (\2%u\2 channels "
+		                                    "matched)."), filter.from, chancount);
+	else if (filtered)
+		(void) command_success_nodata(si, _("No channels matched."));
+	else if (mu != si->smu)
+		(void) command_success_nodata(si, _("\2%s\2 does not have access to any channels."), entity(mu)->name);
 	else
 		(void) command_success_nodata(si, _("You do not have access to any channels."));
 
-	(void) logcommand(si, CMDLOG_GET, "LISTMODES");
+	if (mu != si->smu)
+		(void) logcommand(si, CMDLOG_ADMIN, "LISTMODES: \2%s\2%s%s", entity(mu)->name,
+		                                    filter.glob ? " " : "", filter.glob ? filter.glob : "");
+	else
+		(void) logcommand(si, CMDLOG_GET, "LISTMODES%s%s", filter.glob ? ": " : "",
+		                                  filter.glob ? filter.glob : "");
 }
 
 static struct command cs_cmd_listmodes = {
 	.name           = "LISTMODES",
 	.desc           = N_("Lists the modes of channels that you have access to."),
 	.access         = AC_AUTHENTICATED,
-	.maxparc        = 1,
+	.maxparc        = 10,
 	.cmd            = &cs_cmd_listmodes_fn,
 	.help           = { .path = "freenode/cs_listmodes" },
 };
@@ -94,13 +552,27 @@ mod_init(struct module *const restrict m)
 {
 	MODULE_TRY_REQUEST_DEPENDENCY(m, "chanserv/main")
 
+	(void) hook_add_channel_mode(&listmodes_channel_mode);
+	(void) hook_add_channel_add(&listmodes_channel_change);
+	(void) hook_add_channel_delete(&listmodes_channel_change);
+	(void) hook_add_channel_drop(&listmodes_channel_drop);
 	(void) service_named_bind_command("chanserv", &cs_cmd_listmodes);
 }
 
 static void
 mod_deinit(const enum module_unload_intent ATHEME_VATTR_UNUSED intent)
 {
+	mowgli_patricia_iteration_state_t state;
+	struct mychan *mc;
+
+	(void) hook_del_channel_mode(&listmodes_channel_mode);
+	(void) hook_del_channel_add(&listmodes_channel_change);
+	(void) hook_del_channel_delete(&listmodes_channel_change);
+	(void) hook_del_channel_drop(&listmodes_channel_drop);
 	(void) service_named_unbind_command("chanserv", &cs_cmd_listmodes);
+
+	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+		(void) listmodes_invalidate(mc);
 }
 
 VENDOR_DECLARE_MODULE_V1("freenode/cs_listmodes", MODULE_UNLOAD_CAPABILITY_OK, "Libera Chat <https://libera.chat/>")
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2026 Libera Chat <https://libera.chat/>
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Takes over the ENCAP protocol command and hands each subcommand to the
+ * handlers other modules registered for it, before passing it on to the
+ * protocol module. Modules register through this one instead of wrapping
+ * ENCAP themselves, so they can be loaded and unloaded in any order.
+ */
+
+#define ENCAP_DISPATCH_MODULE
+#include "encap_dispatch.h"
+#ifdef NEED_OLD_COMPAT_INCLUDES
+#include "pmodule.h"
+#endif
+
+struct encap_handler_entry {
+	mowgli_node_t node;
+	encap_handler_fn handler;
+};
+
+unsigned int encap_dispatch_abirev = ENCAP_DISPATCH_ABIREV;
+
+// subcommand -> mowgli_list_t of struct encap_handler_entry
+static mowgli_patricia_t *encap_handlers;
+
+// the protocol module's own ENCAP handler
+static void (*protocol_encap_handler)(sourceinfo_t *, int, char *[]);
+
+static void handler_add(const char *subcmd, encap_handler_fn handler)
+{
+	mowgli_list_t *l = mowgli_patricia_retrieve(encap_handlers, subcmd);
+
+	if (!l)
+	{
+		l = mowgli_list_create();
+		mowgli_patricia_add(encap_handlers, subcmd, l);
+	}
+
+	struct encap_handler_entry *e = smalloc(sizeof *e);
+	e->handler = handler;
+	mowgli_node_add(e, &e->node, l);
+}
+
+static void handler_del(const char *subcmd, encap_handler_fn handler)
+{
+	mowgli_list_t *l = mowgli_patricia_retrieve(encap_handlers, subcmd);
+	mowgli_node_t *n, *tn;
+
+	if (!l)
+		return;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, l->head)
+	{
+		struct encap_handler_entry *e = n->data;
+
+		if (e->handler != handler)
+			continue;
+
+		mowgli_node_delete(&e->node, l);
+		free(e);
+		break;
+	}
+
+	if (!MOWGLI_LIST_LENGTH(l))
+	{
+		mowgli_patricia_delete(encap_handlers, subcmd);
+		mowgli_list_free(l);
+	}
+}
+
+struct encap_dispatch encap_dispatch = {
+	.handler_add = handler_add,
+	.handler_del = handler_del,
+};
+
+static void encap_handler(sourceinfo_t *si, int parc, char *parv[])
+{
+	mowgli_list_t *l = mowgli_patricia_retrieve(encap_handlers, parv[1]);
+	mowgli_node_t *n, *tn;
+
+	// a handler may unregister itself
+	if (l)
+		MOWGLI_ITER_FOREACH_SAFE(n, tn, l->head)
+			((struct encap_handler_entry *) n->data)->handler(si, parc, parv);
+
+	if (protocol_encap_handler)
+		protocol_encap_handler(si, parc, parv);
+}
+
+static void free_handler_list(const char *key, void *data, void *privdata)
+{
+	mowgli_list_t *l = data;
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, l->head)
+	{
+		mowgli_node_delete(n, l);
+		free(n->data);
+	}
+
+	mowgli_list_free(l);
+}
+
+static void mod_init(module_t *m)
+{
+	pcommand_t *old_encap = pcommand_find("ENCAP");
+
+	if (old_encap)
+		protocol_encap_handler = old_encap->handler;
+
+	encap_handlers = mowgli_patricia_create(strcasecanon);
+
+	pcommand_delete("ENCAP");
+	pcommand_add("ENCAP", encap_handler, 2, MSRC_USER | MSRC_SERVER);
+}
+
+static void mod_deinit(module_unload_intent_t intentvoid)
+{
+	pcommand_delete("ENCAP");
+	if (protocol_encap_handler)
+		pcommand_add("ENCAP", protocol_encap_handler, 2, MSRC_USER | MSRC_SERVER);
+
+	mowgli_patricia_destroy(encap_handlers, free_handler_list, NULL);
+}
+
+DECLARE_MODULE_V1 (
+	"freenode/encap_dispatch", MODULE_UNLOAD_CAPABILITY_OK, mod_init, mod_deinit,
+	"", "Libera Chat <https://libera.chat/>"
+);
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2026 Libera Chat <https://libera.chat/>
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Sets of channel name patterns, matched without trying every pattern
+ */
+
+#ifndef CHANMASK_H
+#define CHANMASK_H
+
+/* Patterns are split by how cheaply they can be checked: patterns without
+ * wildcards are looked up by channel name, patterns that are a literal prefix
+ * followed by '*' are looked up by each possible prefix of the channel name,
+ * and only the remaining patterns need to go through match(). Each pattern
+ * carries a data pointer, which is what a match returns; if free_data is set,
+ * the set owns the data and frees it with that.
+ */
+struct chanmask_set
+{
+	mowgli_patricia_t *exact;
+	mowgli_patricia_t *prefixes;
+	size_t min_prefix_len, max_prefix_len;
+	mowgli_list_t globs;
+	void (*free_data)(void *data);
+};
+
+struct chanmask_glob
+{
+	char *pattern;
+	void *data;
+};
+
+static inline void
+chanmask_set_init(struct chanmask_set *set, void (*free_data)(void *data))
+{
+	memset(set, 0, sizeof *set);
+
+	set->exact = mowgli_patricia_create(irccasecanon);
+	set->prefixes = mowgli_patricia_create(irccasecanon);
+	set->min_prefix_len = SIZE_MAX;
+	set->free_data = free_data;
+}
+
+static inline void
+chanmask_set_free_cb(const char *key, void *data, void *privdata)
+{
+	const struct chanmask_set *set = privdata;
+
+	if (set->free_data != NULL)
+		set->free_data(data);
+}
+
+static inline void
+chanmask_set_clear(struct chanmask_set *set)
+{
+	mowgli_node_t *n, *tn;
+
+	if (set->exact != NULL)
+		mowgli_patricia_destroy(set->exact, chanmask_set_free_cb, set);
+	if (set->prefixes != NULL)
+		mowgli_patricia_destroy(set->prefixes, chanmask_set_free_cb, set);
+	set->exact = set->prefixes = NULL;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, set->globs.head)
+	{
+		struct chanmask_glob *glob = n->data;
+
+		chanmask_set_free_cb(NULL, glob->data, set);
+		free(glob->pattern);
+		free(glob);
+		mowgli_node_delete(n, &set->globs);
+		mowgli_node_free(n);
+	}
+}
+
+// The first of several equal patterns is kept
+static inline void
+chanmask_set_add(struct chanmask_set *set, const char *pattern, void *data)
+{
+	const size_t len = strlen(pattern);
+	const size_t wild = strcspn(pattern, "*?\\");
+	mowgli_patricia_t *tree = set->exact;
+	char prefix[BUFSIZE];
+	const char *key = pattern;
+
+	if (wild > 0 && wild == len - 1 && pattern[wild] == '*')
+	{
+		const size_t prefixlen = MIN(wild, sizeof prefix - 1);
+
+		mowgli_strlcpy(prefix, pattern, prefixlen + 1);
+		tree = set->prefixes;
+		key = prefix;
+
+		if (prefixlen < set->min_prefix_len)
+			set->min_prefix_len = prefixlen;
+		if (prefixlen > set->max_prefix_len)
+			set->max_prefix_len = prefixlen;
+	}
+	else if (wild != len)
+	{
+		struct chanmask_glob *glob = smalloc(sizeof *glob);
+
+		glob->pattern = sstrdup(pattern);
+		glob->data = data;
+		mowgli_node_add(glob, mowgli_node_create(), &set->globs);
+		return;
+	}
+
+	if (mowgli_patricia_retrieve(tree, key) == NULL)
+		mowgli_patricia_add(tree, key, data);
+	else
+		chanmask_set_free_cb(NULL, data, set);
+}
+
+static inline void *
+chanmask_set_match(const struct chanmask_set *set, const char *name)
+{
+	char prefix[BUFSIZE];
+	mowgli_node_t *n;
+	void *data;
+	const size_t namelen = strlen(name);
+
+	if ((data = mowgli_patricia_retrieve(set->exact, name)) != NULL)
+		return data;
+
+	for (size_t len = set->min_prefix_len; len <= set->max_prefix_len && len <= namelen; len++)
+	{
+		mowgli_strlcpy(prefix, name, MIN(len + 1, sizeof prefix));
+		if ((data = mowgli_patricia_retrieve(set->prefixes, prefix)) != NULL)
+			return data;
+	}
+
+	MOWGLI_ITER_FOREACH(n, set->globs.head)
+	{
+		const struct chanmask_glob *glob = n->data;
+
+		if (!match(glob->pattern, name))
+			return glob->data;
+	}
+
+	return NULL;
+}
+
+#endif
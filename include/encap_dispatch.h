@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2026 Libera Chat <https://libera.chat/>
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Shared dispatch of ENCAP subcommands
+ * Header for modules registering ENCAP handlers
+ */
+
+#ifndef ENCAP_DISPATCH_H
+#define ENCAP_DISPATCH_H
+
+#include "fn-compat.h"
+#include "atheme.h"
+
+#define ENCAP_DISPATCH_ABIREV 1U
+
+// parv[0] is the target server mask and parv[1] the subcommand, as for ENCAP itself
+typedef void (*encap_handler_fn)(sourceinfo_t *si, int parc, char *parv[]);
+
+struct encap_dispatch {
+	void (*handler_add)(const char *subcmd, encap_handler_fn handler);
+	void (*handler_del)(const char *subcmd, encap_handler_fn handler);
+};
+
+#ifndef ENCAP_DISPATCH_MODULE
+
+#define ENCAP_DISPATCH_MODULE_NAME "freenode/encap_dispatch"
+
+struct encap_dispatch *encap_dispatch;
+
+static inline void encap_dispatch_symbol_impl(module_t *m)
+{
+	unsigned int *abirev;
+	MODULE_TRY_REQUEST_SYMBOL(m, abirev, ENCAP_DISPATCH_MODULE_NAME, "encap_dispatch_abirev");
+	if (*abirev != ENCAP_DISPATCH_ABIREV)
+	{
+		slog(LG_ERROR, "use_encap_dispatch_symbols(): \2%s\2: encap_dispatch ABI revision mismatch (%u != %u), please recompile.", m->name, ENCAP_DISPATCH_ABIREV, *abirev);
+		m->mflags = MODFLAG_FAIL;
+		return;
+	}
+
+	MODULE_TRY_REQUEST_SYMBOL(m, encap_dispatch, ENCAP_DISPATCH_MODULE_NAME, "encap_dispatch");
+}
+
+// needed because MODULE_TRY_REQUEST_SYMBOL will "return" on our behalf
+static inline bool use_encap_dispatch_symbols(module_t *m)
+{
+	encap_dispatch_symbol_impl(m);
+	return m->mflags != MODFLAG_FAIL;
+}
+
+#endif
+
+#endif
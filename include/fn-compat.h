@@ -31,6 +31,8 @@ COMPAT_TYPEDEF(struct, hook_channel_register_check)
 COMPAT_TYPEDEF(struct, hook_channel_req)
 COMPAT_TYPEDEF(struct, hook_channel_succession_req)
 COMPAT_TYPEDEF(struct, hook_user_req)
+COMPAT_TYPEDEF(struct, hook_user_rename)
+COMPAT_TYPEDEF(struct, logfile)
 COMPAT_TYPEDEF(struct, metadata)
 COMPAT_TYPEDEF(enum,   module_unload_intent)
 COMPAT_TYPEDEF(struct, module)
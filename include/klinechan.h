@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2026 Libera Chat <https://libera.chat/>
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Interface of os_klinechan for other modules
+ */
+
+#ifndef KLINECHAN_H
+#define KLINECHAN_H
+
+#define KLINECHAN_MODULE	"contrib/os_klinechan"
+
+/* privatedata key of the struct klinechan on a registered channel */
+#define KLINECHAN_PRIVDATA	"klinechan:record"
+
+/* Whether joining the named channel gets users klined, either because the
+ * channel itself is a klinechan or because it matches a klinechan mask.
+ * Look it up with module_locate_symbol(KLINECHAN_MODULE, "klinechan_covers").
+ */
+bool klinechan_covers(const char *name);
+
+#endif
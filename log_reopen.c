@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2026 Libera Chat <https://libera.chat/>
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Reopens log files when asked to through a control file, so log rotation
+ * does not need a SIGHUP and the full configuration rehash that comes with it.
+ *
+ * fn-rotatelogs creates the control file after renaming the logs; we look
+ * for it periodically, reopen every log file by its path and remove it again.
+ */
+
+#include "fn-compat.h"
+#include "atheme.h"
+
+#define LOG_REOPEN_FILE "atheme.logreopen"
+#define LOG_REOPEN_INTERVAL 5
+
+static mowgli_eventloop_timer_t *log_reopen_timer;
+
+static unsigned int log_reopen_all(void)
+{
+	mowgli_node_t *n;
+	unsigned int count = 0;
+
+	MOWGLI_ITER_FOREACH(n, log_files.head)
+	{
+		logfile_t *lf = n->data;
+		FILE *f;
+
+		// channel logs and the like have no file to reopen
+		if (lf->log_type != LOG_NONINTERACTIVE || !lf->log_file || !lf->log_path)
+			continue;
+
+		if (!(f = fopen(lf->log_path, "a")))
+		{
+			slog(LG_ERROR, "log_reopen_all(): cannot reopen %s: %s, keeping the old file open", lf->log_path, strerror(errno));
+			continue;
+		}
+
+		setvbuf(f, NULL, _IOLBF, 0);
+		fclose(lf->log_file);
+		lf->log_file = f;
+		count++;
+	}
+
+	return count;
+}
+
+static void log_reopen_check(void *unused)
+{
+	char path[BUFSIZE];
+
+	snprintf(path, sizeof path, "%s/%s", LOGDIR, LOG_REOPEN_FILE);
+
+	// a single unlink tells us whether the file was there and acknowledges it
+	if (unlink(path) != 0)
+	{
+		if (errno != ENOENT)
+			slog(LG_ERROR, "log_reopen_check(): cannot remove %s: %s", path, strerror(errno));
+		return;
+	}
+
+	unsigned int count = log_reopen_all();
+	slog(LG_INFO, "log_reopen_check(): reopened %u log files", count);
+}
+
+static void mod_init(module_t *m)
+{
+	log_reopen_timer = mowgli_timer_add(base_eventloop, "log_reopen_check", log_reopen_check, NULL, LOG_REOPEN_INTERVAL);
+}
+
+static void mod_deinit(module_unload_intent_t intentvoid)
+{
+	mowgli_timer_destroy(base_eventloop, log_reopen_timer);
+}
+
+DECLARE_MODULE_V1 (
+	"freenode/log_reopen", MODULE_UNLOAD_CAPABILITY_OK, mod_init, mod_deinit,
+	"", "Libera Chat <https://libera.chat/>"
+);
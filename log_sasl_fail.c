@@ -1,34 +1,343 @@
+/*
+ * Logs SASL login failures reported by the ircd.
+ *
+ * Failures are counted per account and per source IP and written out as
+ * periodic summaries, so that a flood of failed logins costs one log line
+ * per account or IP and interval rather than one per failure.
+ *
+ * Each account and IP also has a leaky bucket; when failures come in faster
+ * than the configured threshold allows, opers are alerted.
+ */
+
 #include "fn-compat.h"
 #include "atheme.h"
-#ifdef NEED_OLD_COMPAT_INCLUDES
-#include "pmodule.h"
-#endif
+#include "encap_dispatch.h"
+
+// Alerts sent to opers in total, per minute
+#define SASLFAIL_ALERT_BURST 5U
+
+// Least recently failed entries looked at when one has to be evicted
+#define SASLFAIL_EVICT_SCAN 16U
+
+// Failures seen for one account or one IP since the last summary
+struct saslfail_entry {
+	mowgli_node_t lru_n;
+	char *key;
+	char *last_other; // the IP an account was last tried from, or the account last tried from an IP
+	unsigned int count;
+	time_t first, last;
+	// Leaky bucket: each failure adds THRESHOLD_PERIOD units, and the threshold leaks out per second
+	uint64_t level;
+	time_t level_ts;
+	time_t alerted;
+};
+
+struct saslfail_table {
+	const char *name;
+	mowgli_patricia_t *index;
+	mowgli_list_t lru; // most recently failed first
+	unsigned int evicted_entries;
+	unsigned int evicted_failures;
+	unsigned int *threshold;
+};
+
+static mowgli_list_t saslfail_conf_table;
+static unsigned int saslfail_interval;
+static unsigned int saslfail_max_entries;
+static bool saslfail_verbose;
+static unsigned int saslfail_account_threshold;
+static unsigned int saslfail_ip_threshold;
+static unsigned int saslfail_period;
+static unsigned int saslfail_alert_interval;
+static bool saslfail_mark;
+
+static struct saslfail_table saslfail_accounts = { .name = "account", .threshold = &saslfail_account_threshold };
+static struct saslfail_table saslfail_hosts = { .name = "IP", .threshold = &saslfail_ip_threshold };
+
+static time_t saslfail_alert_window;
+static unsigned int saslfail_alerts_sent;
+static unsigned int saslfail_alerts_suppressed;
+
+static mowgli_eventloop_timer_t *saslfail_timer;
+static unsigned int saslfail_timer_interval;
+
+static void saslfail_entry_free(struct saslfail_table *table, struct saslfail_entry *e)
+{
+	mowgli_patricia_delete(table->index, e->key);
+	mowgli_node_delete(&e->lru_n, &table->lru);
+	free(e->key);
+	free(e->last_other);
+	free(e);
+}
+
+// Drains the bucket for the time passed since it was last updated; with no threshold, there is no bucket
+static void saslfail_bucket_leak(const struct saslfail_table *table, struct saslfail_entry *e)
+{
+	const uint64_t leaked = (uint64_t) (CURRTIME - e->level_ts) * *table->threshold;
+
+	e->level = (!*table->threshold || leaked >= e->level) ? 0 : e->level - leaked;
+	e->level_ts = CURRTIME;
+}
+
+/* Picks the entry to drop when the table is full: among the least recently failed ones, the
+ * first whose bucket has drained, or else the one furthest from the threshold, so that a flood
+ * of new keys does not push out those that are about to trigger an alert.
+ */
+static struct saslfail_entry *saslfail_evict_victim(const struct saslfail_table *table)
+{
+	struct saslfail_entry *victim = NULL;
+	unsigned int scanned = 0;
+	mowgli_node_t *n;
+
+	for (n = table->lru.tail; n && scanned < SASLFAIL_EVICT_SCAN; n = n->prev, scanned++)
+	{
+		struct saslfail_entry *e = n->data;
+
+		saslfail_bucket_leak(table, e);
+
+		if (!e->level)
+			return e;
+
+		if (!victim || e->level < victim->level)
+			victim = e;
+	}
+
+	return victim;
+}
+
+static void saslfail_alert(const struct saslfail_table *table, struct saslfail_entry *e)
+{
+	if (e->alerted && CURRTIME - e->alerted < (time_t) saslfail_alert_interval)
+		return;
+
+	e->alerted = CURRTIME;
+
+	slog(LG_INFO, "SASLFAIL: more than %u login failures per %u seconds for %s %s, last %s",
+			*table->threshold, saslfail_period, table->name, e->key, e->last_other);
+
+	if (CURRTIME - saslfail_alert_window >= 60)
+	{
+		if (saslfail_alerts_suppressed)
+			wallops("%u further SASL brute-force alerts were not shown; see the services log.",
+					saslfail_alerts_suppressed);
+
+		saslfail_alert_window = CURRTIME;
+		saslfail_alerts_sent = saslfail_alerts_suppressed = 0;
+	}
+
+	if (saslfail_alerts_sent >= SASLFAIL_ALERT_BURST)
+	{
+		saslfail_alerts_suppressed++;
+		return;
+	}
+
+	saslfail_alerts_sent++;
+
+	if (table == &saslfail_accounts)
+		wallops("Possible SASL brute force against account \2%s\2: more than %u failures in %u seconds, "
+				"last from %s", e->key, *table->threshold, saslfail_period, e->last_other);
+	else
+		wallops("Possible SASL brute force from \2%s\2: more than %u failures in %u seconds, last "
+				"against %s", e->key, *table->threshold, saslfail_period, e->last_other);
+
+	if (saslfail_mark && table == &saslfail_accounts)
+	{
+		myuser_t *mu = myuser_find(e->key);
+		char buf[BUFSIZE];
+
+		if (mu)
+		{
+			snprintf(buf, sizeof buf, "%lu", (unsigned long) CURRTIME);
+			metadata_add(mu, "private:saslfail:alerted", buf);
+		}
+	}
+}
+
+static void saslfail_bucket_fill(const struct saslfail_table *table, struct saslfail_entry *e)
+{
+	if (!*table->threshold || !saslfail_period)
+		return;
+
+	saslfail_bucket_leak(table, e);
+	e->level += saslfail_period;
+
+	if (e->level > (uint64_t) *table->threshold * saslfail_period)
+		saslfail_alert(table, e);
+}
+
+static void saslfail_record(struct saslfail_table *table, const char *key, const char *other)
+{
+	struct saslfail_entry *e = mowgli_patricia_retrieve(table->index, key);
 
-void (*old_encap_handler)(sourceinfo_t *, int, char *[]) = 0;
+	if (e)
+	{
+		mowgli_node_delete(&e->lru_n, &table->lru);
+	}
+	else
+	{
+		// Make room by dropping an entry that failed a while ago; it is still counted in the next summary
+		if (saslfail_max_entries && MOWGLI_LIST_LENGTH(&table->lru) >= saslfail_max_entries)
+		{
+			struct saslfail_entry *victim = saslfail_evict_victim(table);
 
-static void encap_handler(sourceinfo_t *si, int parc, char *parv[])
+			table->evicted_entries++;
+			table->evicted_failures += victim->count;
+			saslfail_entry_free(table, victim);
+		}
+
+		e = smalloc(sizeof *e);
+		e->key = sstrdup(key);
+		mowgli_patricia_add(table->index, e->key, e);
+	}
+
+	if (!e->last_other || strcmp(e->last_other, other) != 0)
+	{
+		free(e->last_other);
+		e->last_other = sstrdup(other);
+	}
+
+	if (!e->count)
+		e->first = CURRTIME;
+
+	e->count++;
+	e->last = CURRTIME;
+	mowgli_node_add_head(e, &e->lru_n, &table->lru);
+
+	saslfail_bucket_fill(table, e);
+}
+
+static void saslfail_flush_table(struct saslfail_table *table)
+{
+	mowgli_node_t *n, *tn;
+	char first[32], last[32];
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, table->lru.head)
+	{
+		struct saslfail_entry *e = n->data;
+
+		// Idle: nothing since the last summary, the bucket has drained and no alert is being held back
+		if (!e->count)
+		{
+			saslfail_bucket_leak(table, e);
+
+			if (!e->level && CURRTIME - e->alerted >= (time_t) saslfail_alert_interval)
+				saslfail_entry_free(table, e);
+
+			continue;
+		}
+
+		strftime(first, sizeof first, "%Y-%m-%d %H:%M:%S", localtime(&e->first));
+		strftime(last, sizeof last, "%Y-%m-%d %H:%M:%S", localtime(&e->last));
+
+		if (table == &saslfail_accounts)
+			slog(LG_CMD_REQUEST, "SASL login failures by %s: %u between %s and %s, last from %s",
+					e->key, e->count, first, last, e->last_other);
+		else
+			slog(LG_CMD_REQUEST, "SASL login failures from %s: %u between %s and %s, last by %s",
+					e->key, e->count, first, last, e->last_other);
+
+		e->count = 0;
+	}
+
+	if (table->evicted_entries)
+		slog(LG_CMD_REQUEST, "SASL login failures: %u more from %u other %ss not tracked individually",
+				table->evicted_failures, table->evicted_entries, table->name);
+
+	table->evicted_entries = table->evicted_failures = 0;
+}
+
+static void saslfail_flush(void *unused)
 {
-    if (!irccasecmp(parv[1], "SASLFAIL"))
-    {
-	if (parc < 6) return;
-	slog(LG_CMD_REQUEST, "SASL login failure by %s from %s(%s)", parv[2], parv[5], parv[6]);
-    }
-    if (old_encap_handler)
-	old_encap_handler(si, parc, parv);
+	saslfail_flush_table(&saslfail_accounts);
+	saslfail_flush_table(&saslfail_hosts);
+}
+
+static void saslfail_table_clear(struct saslfail_table *table)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, table->lru.head)
+		saslfail_entry_free(table, n->data);
+}
+
+static void saslfail_schedule(void *unused)
+{
+	if (!saslfail_interval)
+		saslfail_interval = 60;
+
+	if (saslfail_timer && saslfail_timer_interval == saslfail_interval)
+		return;
+
+	if (saslfail_timer)
+		mowgli_timer_destroy(base_eventloop, saslfail_timer);
+
+	saslfail_timer_interval = saslfail_interval;
+	saslfail_timer = mowgli_timer_add(base_eventloop, "saslfail_flush", saslfail_flush, NULL, saslfail_interval);
+}
+
+static void saslfail_handler(sourceinfo_t *si, int parc, char *parv[])
+{
+	// parv[2] is the account, parv[5] and parv[6] the host and IP
+	if (parc < 7)
+		return;
+
+	if (saslfail_verbose)
+		slog(LG_CMD_REQUEST, "SASL login failure by %s from %s(%s)", parv[2], parv[5], parv[6]);
+
+	saslfail_record(&saslfail_accounts, parv[2], parv[6]);
+	saslfail_record(&saslfail_hosts, parv[6], parv[2]);
 }
 
 static void mod_init(module_t *m)
 {
-    pcommand_t *old_encap = pcommand_find("ENCAP");
-    if (old_encap) old_encap_handler = old_encap->handler;
-    pcommand_delete("ENCAP");
-    pcommand_add("ENCAP", encap_handler, 2, MSRC_USER | MSRC_SERVER);
+	if (!use_encap_dispatch_symbols(m))
+		return;
+
+	saslfail_accounts.index = mowgli_patricia_create(irccasecanon);
+	saslfail_hosts.index = mowgli_patricia_create(strcasecanon);
+
+	add_subblock_top_conf("SASLFAIL", &saslfail_conf_table);
+	add_duration_conf_item("SUMMARY_INTERVAL", &saslfail_conf_table, 0, &saslfail_interval, "m", 60);
+	add_uint_conf_item("MAX_ENTRIES", &saslfail_conf_table, 0, &saslfail_max_entries, 0, 1000000, 4096);
+	add_bool_conf_item("VERBOSE", &saslfail_conf_table, 0, &saslfail_verbose, false);
+	add_uint_conf_item("ACCOUNT_THRESHOLD", &saslfail_conf_table, 0, &saslfail_account_threshold, 0, 100000, 20);
+	add_uint_conf_item("IP_THRESHOLD", &saslfail_conf_table, 0, &saslfail_ip_threshold, 0, 100000, 50);
+	add_duration_conf_item("THRESHOLD_PERIOD", &saslfail_conf_table, 0, &saslfail_period, "m", 60);
+	add_duration_conf_item("ALERT_INTERVAL", &saslfail_conf_table, 0, &saslfail_alert_interval, "m", 600);
+	add_bool_conf_item("MARK_ACCOUNTS", &saslfail_conf_table, 0, &saslfail_mark, false);
+
+	hook_add_config_ready(saslfail_schedule);
+	saslfail_schedule(NULL);
+
+	encap_dispatch->handler_add("SASLFAIL", saslfail_handler);
 }
 
 static void mod_deinit(module_unload_intent_t intentvoid)
 {
-    pcommand_delete("ENCAP");
-    if (old_encap_handler) pcommand_add("ENCAP", old_encap_handler, 2, MSRC_USER | MSRC_SERVER);
+	encap_dispatch->handler_del("SASLFAIL", saslfail_handler);
+
+	// Don't lose what has been counted so far
+	saslfail_flush(NULL);
+
+	if (saslfail_timer)
+		mowgli_timer_destroy(base_eventloop, saslfail_timer);
+
+	hook_del_config_ready(saslfail_schedule);
+
+	del_conf_item("SUMMARY_INTERVAL", &saslfail_conf_table);
+	del_conf_item("MAX_ENTRIES", &saslfail_conf_table);
+	del_conf_item("VERBOSE", &saslfail_conf_table);
+	del_conf_item("ACCOUNT_THRESHOLD", &saslfail_conf_table);
+	del_conf_item("IP_THRESHOLD", &saslfail_conf_table);
+	del_conf_item("THRESHOLD_PERIOD", &saslfail_conf_table);
+	del_conf_item("ALERT_INTERVAL", &saslfail_conf_table);
+	del_conf_item("MARK_ACCOUNTS", &saslfail_conf_table);
+	del_top_conf("SASLFAIL");
+
+	saslfail_table_clear(&saslfail_accounts);
+	saslfail_table_clear(&saslfail_hosts);
+	mowgli_patricia_destroy(saslfail_accounts.index, NULL, NULL);
+	mowgli_patricia_destroy(saslfail_hosts.index, NULL, NULL);
 }
 
 DECLARE_MODULE_V1 (
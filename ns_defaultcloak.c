@@ -6,9 +6,18 @@
 
 #include "atheme.h"
 
-// Cloak prefix, must be non-empty
+// Default cloak prefix; the configured one must be non-empty as well
 #define CLOAK_PREFIX        "user/"
-#define CLOAK_PREFIX_LEN    strlen(CLOAK_PREFIX)
+
+// Character classes for nsdc_chartab, by the casefolded character unless noted
+#define NSDC_CH_DIGIT       0x01U
+#define NSDC_CH_ALPHA       0x02U
+#define NSDC_CH_DASH        0x04U
+#define NSDC_CH_UNDERSCORE  0x08U
+#define NSDC_CH_INVALID     0x10U   // by the character itself: anything but [A-Za-z0-9-] forces a hash
+
+// Send a progress notice every this many ticks
+#define NSDC_JOB_PROGRESS   30U
 
 struct setter
 {
@@ -17,107 +26,448 @@ struct setter
 	bool                needs_force;
 };
 
+/* A running DEFAULTCLOAK MASK or MIGRATE. Candidate accounts are snapshotted by entity ID when it
+ * starts; everything else, including the mark checks, is done a batch at a time as it runs.
+ */
+struct nsdc_job
+{
+	char *                      requester;  // entity ID of the requesting account, may be NULL
+	char *                      assigner;   // recorded as private:usercloak-assigner
+	char *                      name;       // e.g. "MASK foo*", for notices and logs
+	char *                      pattern;    // for MASK: checked again, as accounts may be renamed
+	char *                      old_prefix; // for MIGRATE: only replace cloaks still built with this prefix
+	uint32_t                    old_iv;
+	bool                        force;
+	bool                        can_override; // FORCE was given and the requester may override marks
+	bool                        dryrun;
+	char **                     ids;
+	size_t                      count;
+	size_t                      next;
+	unsigned int                ticks;
+	unsigned int                matched;
+	unsigned int                changed;    // or for a dry run, would have been changed
+	unsigned int                unchanged;  // already had the default cloak
+	unsigned int                vanished;   // dropped since the job started
+	unsigned int                skipped_self;
+	unsigned int                skipped_marked;
+	unsigned int                overridden;
+	mowgli_eventloop_timer_t *  timer;
+};
+
 static bool nsdc_autocloak = true;
+static char *nsdc_digit_lead = NULL;
+static unsigned int nsdc_hash_width = 5;
+static char *nsdc_prefix = NULL;
+static unsigned int nsdc_job_batch = 100;   // accounts handled per second by DEFAULTCLOAK MASK/MIGRATE
+
+// Prefix that hash_iv was calculated for
+static char *hash_iv_prefix = NULL;
 static uint32_t hash_iv = 0;
 
+static struct
+{
+	unsigned char   fold;
+	unsigned char   flags;
+} nsdc_chartab[256];
+static struct nsdc_job *nsdc_job = NULL;
+
+/* Maps assigned cloaks (private:usercloak) to the entity IDs of their accounts; built on first use.
+ * Cloaks can be changed behind our back, so entries may be stale and are verified when looked up.
+ */
+static mowgli_patricia_t *nsdc_cloaks = NULL;
+
+static uint32_t
+nsdc_calc_hash_iv(const char *const restrict prefix)
+{
+	uint32_t iv = 0;
+
+	// FNV-0 to calculate an offset that isn't the default one
+	for (const char *p = prefix; *p != '\0'; p++)
+	{
+		iv ^= (uint32_t) *p;
+		iv *= 16777619;
+	}
+
+	return iv;
+}
+
 static void
 nsdc_init_hash(void)
 {
-	// FNV-0 to calculate an offset that isn't the default one
-	for (const char *p = CLOAK_PREFIX; *p != '\0'; p++)
+	const char *prefix = nsdc_prefix;
+
+	if (! prefix || ! *prefix || strlen(prefix) > (HOSTLEN / 2) || strchr(prefix, ' '))
 	{
-		hash_iv ^= (uint32_t) *p;
-		hash_iv *= 16777619;
+		if (prefix)
+			(void) slog(LG_ERROR, "%s: invalid DEFAULTCLOAK_PREFIX \2%s\2, using %s", MOWGLI_FUNC_NAME,
+			                      prefix, CLOAK_PREFIX);
+
+		prefix = CLOAK_PREFIX;
 	}
+
+	if (hash_iv_prefix && strcmp(hash_iv_prefix, prefix) == 0)
+		return;
+
+	if (hash_iv_prefix)
+		(void) slog(LG_INFO, "%s: default cloak prefix changed from %s to %s", MOWGLI_FUNC_NAME,
+		                     hash_iv_prefix, prefix);
+
+	(void) free(hash_iv_prefix);
+	hash_iv_prefix = sstrdup(prefix);
+	hash_iv = nsdc_calc_hash_iv(prefix);
 }
 
-static bool
-nsdc_build_cloak(const char *const restrict accname, char *const restrict newhost, const size_t hostlen)
+// The digit lead is a single letter or dash; a digit would let the cloak start with one after all
+static void
+nsdc_check_digit_lead(void)
 {
-	size_t i = (CLOAK_PREFIX_LEN - 1);
-	bool invalidchar = false;
-	uint32_t hash = hash_iv;
+	const char *const lead = nsdc_digit_lead;
+
+	if (lead && lead[0] != '\0' && lead[1] == '\0' &&
+	    ((lead[0] >= 'A' && lead[0] <= 'Z') || (lead[0] >= 'a' && lead[0] <= 'z') || lead[0] == '-'))
+		return;
+
+	if (lead)
+		(void) slog(LG_ERROR, "%s: invalid DEFAULTCLOAK_DIGIT_LEAD \2%s\2 (must be one letter or -), using -",
+		                      MOWGLI_FUNC_NAME, lead);
+
+	(void) free(nsdc_digit_lead);
+	nsdc_digit_lead = sstrdup("-");
+}
 
-	(void) mowgli_strlcpy(newhost, CLOAK_PREFIX, hostlen);
+static void
+nsdc_config_ready(void *const ATHEME_VATTR_UNUSED unused)
+{
+	(void) nsdc_init_hash();
+	(void) nsdc_check_digit_lead();
+}
 
-	// Search for invalid characters. This changes copying behavior
-	for (const char *p = accname; *p != '\0'; p++)
+static void
+nsdc_init_chartab(void)
+{
+	for (unsigned int b = 0; b < 256; b++)
 	{
-		if (*p == '-')
-			continue;
+		const unsigned char c = (unsigned char) ToUpper(b);
+		unsigned char flags = 0;
+
+		// Deliberately not isalnum() and friends, so cloaks do not depend on the locale
+		if (c >= '0' && c <= '9')
+			flags |= NSDC_CH_DIGIT;
+		else if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+			flags |= NSDC_CH_ALPHA;
+		else if (c == '-')
+			flags |= NSDC_CH_DASH;
+		else if (c == '_')
+			flags |= NSDC_CH_UNDERSCORE;
 
-		if (isalnum((unsigned char) *p))
-			continue;
+		if (! ((b >= '0' && b <= '9') || (b >= 'A' && b <= 'Z') || (b >= 'a' && b <= 'z') || b == '-'))
+			flags |= NSDC_CH_INVALID;
 
-		invalidchar = true;
-		break;
+		nsdc_chartab[b].fold = c;
+		nsdc_chartab[b].flags = flags;
 	}
+}
+
+/* Appends the cloak form of one account name character. Dashes are collapsed
+ * only in cloaks that get a hash, as otherwise the name must stay unique as is.
+ * Returns false if there is no room left.
+ */
+static inline bool
+nsdc_emit(char *const restrict newhost, size_t *const restrict len, const size_t hostlen, const size_t prefixlen,
+          const unsigned char ch, const unsigned char flags, const bool invalidchar, size_t *const restrict leadend)
+{
+	if (*len >= (hostlen - 1))
+		return false;
 
-	// Copy the cloak and calculate the hash from casefolded characters
-	for (const char *p = accname; *p != '\0'; p++)
+	if (flags & NSDC_CH_DIGIT)
 	{
-		const int c = ToUpper((unsigned char) *p);
+		// Cloaks must not look like IP addresses
+		if (*len == prefixlen)
+		{
+			if (*len + 1 >= (hostlen - 1))
+				return false;
 
-		hash ^= (uint32_t) c;
-		hash *= 16777619;
+			newhost[(*len)++] = nsdc_digit_lead[0];
+			*leadend = *len;
+		}
+
+		newhost[(*len)++] = (char) ch;
+	}
+	else if (flags & NSDC_CH_ALPHA)
+	{
+		newhost[(*len)++] = (char) ch;
+	}
+	else if (flags & NSDC_CH_DASH)
+	{
+		if ((! invalidchar) || (newhost[*len - 1] != '-'))
+			newhost[(*len)++] = '-';
+	}
+	else if (flags & NSDC_CH_UNDERSCORE)
+	{
+		if (newhost[*len - 1] != '-')
+			newhost[(*len)++] = '-';
+	}
+
+	return true;
+}
+
+/* Collapses runs of dashes written before we knew the cloak would get a hash,
+ * giving what nsdc_emit() would have written had it known from the start.
+ */
+static size_t
+nsdc_collapse_dashes(char *const restrict newhost, const size_t len, const size_t prefixlen, const size_t leadend)
+{
+	size_t out = prefixlen;
 
-		if (i >= (hostlen - 1))
+	for (size_t in = prefixlen; in < len; in++)
+	{
+		if (newhost[in] == '-' && newhost[out - 1] == '-' && in >= leadend)
 			continue;
 
-		if (isdigit(c))
-		{
-			if (i == (CLOAK_PREFIX_LEN - 1))
-				newhost[++i] = '-';
+		newhost[out++] = newhost[in];
+	}
 
-			newhost[++i] = *p;
-		}
-		else if (isalpha(c))
+	return out;
+}
+
+// Builds the cloak an account name would get with the given prefix and its hash_iv
+static bool
+nsdc_build_cloak_as(const char *const restrict prefix, const uint32_t iv, const char *const restrict accname,
+                    char *const restrict newhost, const size_t hostlen)
+{
+	const size_t prefixlen = strlen(prefix);
+	size_t len = prefixlen;
+	size_t leadend = 0;
+	bool invalidchar = false;
+	bool truncated = false;
+	uint32_t hash = iv;
+
+	(void) mowgli_strlcpy(newhost, prefix, hostlen);
+
+	// Copy the cloak and calculate the hash from casefolded characters, in one pass
+	for (const unsigned char *p = (const unsigned char *) accname; *p != '\0'; p++)
+	{
+		const unsigned char flags = nsdc_chartab[*p].flags;
+
+		hash ^= (uint32_t) nsdc_chartab[*p].fold;
+		hash *= 16777619;
+
+		if ((flags & NSDC_CH_INVALID) && ! invalidchar)
 		{
-			newhost[++i] = *p;
+			// This changes copying behavior, including for what we have copied so far
+			invalidchar = true;
+			len = nsdc_collapse_dashes(newhost, len, prefixlen, leadend);
 		}
-		else if (c == '-')
+
+		if (! truncated && ! nsdc_emit(newhost, &len, hostlen, prefixlen, *p, flags, invalidchar, &leadend))
+			truncated = true;
+	}
+
+	if (truncated && invalidchar)
+	{
+		// Collapsing may have made room for characters we dropped; only happens for overlong names
+		len = prefixlen;
+		leadend = 0;
+
+		for (const unsigned char *p = (const unsigned char *) accname; *p != '\0'; p++)
+			if (! nsdc_emit(newhost, &len, hostlen, prefixlen, *p, nsdc_chartab[*p].flags, true, &leadend))
+				break;
+	}
+
+	if (len == prefixlen)
+	{
+		// Yes, you're very clever. Have an easter egg
+		(void) mowgli_strlcpy(newhost + len, "...", hostlen - len);
+
+		len = strlen(newhost);
+	}
+
+	if (invalidchar)
+	{
+		if (nsdc_hash_width == 5)
 		{
-			if ((! invalidchar) || (newhost[i] != '-'))
-				newhost[++i] = '-';
+			// Fold hash value to fit in 5 digits
+			hash = (hash >> 17) + (hash & 0xFFFF);
 		}
-		else if (c == '_')
+		else
 		{
-			if (newhost[i] != '-')
-				newhost[++i] = '-';
+			uint32_t limit = 1;
+
+			for (unsigned int n = 0; n < nsdc_hash_width; n++)
+				limit *= 10;
+
+			hash %= limit;
 		}
+
+		(void) snprintf(newhost + len, hostlen - len, ":%0*" PRIu32, (int) nsdc_hash_width, hash);
 	}
+	else
+		newhost[len] = '\0';
 
-	// Bump i to denote the number of bytes written
-	i++;
+	return invalidchar;
+}
 
-	if (i == CLOAK_PREFIX_LEN)
+static bool
+nsdc_build_cloak(const char *const restrict accname, char *const restrict newhost, const size_t hostlen)
+{
+	return nsdc_build_cloak_as(hash_iv_prefix, hash_iv, accname, newhost, hostlen);
+}
+
+static void
+nsdc_index_free(const char ATHEME_VATTR_UNUSED *const restrict key, void *const restrict id,
+                void ATHEME_VATTR_UNUSED *const restrict unused)
+{
+	(void) free(id);
+}
+
+// Indexes every account's cloak; reports (to si, if given) and returns the number of collisions found
+static unsigned int
+nsdc_index_build(struct sourceinfo *const restrict si)
+{
+	struct myentity_iteration_state state;
+	const struct metadata *md;
+	unsigned int collisions = 0;
+	struct myentity *mt;
+	const char *other;
+
+	if (nsdc_cloaks)
+		(void) mowgli_patricia_destroy(nsdc_cloaks, &nsdc_index_free, NULL);
+
+	nsdc_cloaks = mowgli_patricia_create(&strcasecanon);
+
+	MYENTITY_FOREACH_T(mt, &state, ENT_USER)
 	{
-		// Yes, you're very clever. Have an easter egg
-		(void) mowgli_strlcpy(newhost + i, "...", hostlen - i);
+		struct myuser *const mu = user(mt);
+
+		if (! (md = metadata_find(mu, "private:usercloak")))
+			continue;
+
+		if ((other = mowgli_patricia_retrieve(nsdc_cloaks, md->value)))
+		{
+			collisions++;
 
-		i += 3;
+			if (si)
+				(void) command_success_nodata(si, _("Cloak \2%s\2 is shared by \2%s\2 and \2%s\2."),
+				                                    md->value, entity(myuser_find_uid(other))->name,
+				                                    entity(mu)->name);
+			continue;
+		}
+
+		(void) mowgli_patricia_add(nsdc_cloaks, md->value, sstrdup(entity(mu)->id));
 	}
 
-	if (invalidchar)
+	return collisions;
+}
+
+// Returns the account holding a cloak, or NULL; stale index entries are dropped on the way
+static struct myuser *
+nsdc_index_lookup(const char *const restrict cloak)
+{
+	const struct metadata *md;
+	struct myuser *mu;
+	char *id;
+
+	if (! nsdc_cloaks)
+		(void) nsdc_index_build(NULL);
+
+	if (! (id = mowgli_patricia_retrieve(nsdc_cloaks, cloak)))
+		return NULL;
+
+	/* The account may have been dropped, or its cloak changed by other modules (e.g. VHOST),
+	 * since it was indexed, so verify the hit
+	 */
+	if ((mu = myuser_find_uid(id)) && (md = metadata_find(mu, "private:usercloak")) &&
+	    strcasecmp(md->value, cloak) == 0)
+		return mu;
+
+	(void) mowgli_patricia_delete(nsdc_cloaks, cloak);
+	(void) free(id);
+	return NULL;
+}
+
+static void
+nsdc_index_remove(struct myuser *const restrict mu)
+{
+	const struct metadata *md;
+	char *id;
+
+	if (! nsdc_cloaks || ! (md = metadata_find(mu, "private:usercloak")))
+		return;
+
+	if ((id = mowgli_patricia_retrieve(nsdc_cloaks, md->value)) && strcmp(id, entity(mu)->id) == 0)
 	{
-		// Fold hash value to fit in 5 digits
-		hash = (hash >> 17) + (hash & 0xFFFF);
+		(void) mowgli_patricia_delete(nsdc_cloaks, md->value);
+		(void) free(id);
+	}
+}
 
-		(void) snprintf(newhost + i, hostlen - i, ":%05" PRIu32, hash);
+/* Builds the default cloak for an account. If another account already holds it,
+ * the cloak is extended with -2, -3, ... until it is unique.
+ */
+static bool
+nsdc_default_cloak(struct myuser *const restrict mu, char *const restrict newhost, const size_t hostlen)
+{
+	const bool invalidchar = nsdc_build_cloak(entity(mu)->name, newhost, hostlen);
+	struct myuser *holder = nsdc_index_lookup(newhost);
+
+	if (! holder || holder == mu)
+		return invalidchar;
+
+	const size_t baselen = strlen(newhost);
+	char suffix[16];
+
+	for (unsigned int n = 2; holder && holder != mu; n++)
+	{
+		const int suffixlen = snprintf(suffix, sizeof suffix, "-%u", n);
+
+		// Make room for the suffix if the cloak is already as long as it may be
+		const size_t len = MIN(baselen, hostlen - 1 - (size_t) suffixlen);
+
+		(void) mowgli_strlcpy(newhost + len, suffix, hostlen - len);
+
+		holder = nsdc_index_lookup(newhost);
 	}
-	else
-		newhost[i] = '\0';
 
 	return invalidchar;
 }
 
 static void
-nsdc_change_vhost(struct myuser *const restrict mu, const char *const restrict newhost, const bool invalidchar,
-                  const struct setter *const restrict setter)
+nsdc_apply_cloak(struct myuser *const restrict mu, const char *const restrict newhost, const bool invalidchar,
+                 const char *const restrict assigner)
 {
 	char timestring[16];
 	mowgli_node_t *n;
 
+	if (assigner)
+		(void) metadata_add(mu, "private:usercloak-assigner", assigner);
+
+	if (! nsdc_cloaks)
+		(void) nsdc_index_build(NULL);
+
+	(void) nsdc_index_remove(mu);
+
+	// Whatever is still indexed under the new cloak is stale, or nsdc_default_cloak() would have avoided it
+	(void) free(mowgli_patricia_delete(nsdc_cloaks, newhost));
+	(void) mowgli_patricia_add(nsdc_cloaks, newhost, sstrdup(entity(mu)->id));
+
+	(void) snprintf(timestring, sizeof timestring, "%lu", (unsigned long) time(NULL));
+	(void) metadata_add(mu, "private:usercloak-timestamp", timestring);
+	(void) metadata_add(mu, "private:usercloak", newhost);
+
+	(void) myuser_notice(nicksvs.nick, mu, "You have been given a default user cloak.");
+
+	if (invalidchar)
+		(void) myuser_notice(nicksvs.nick, mu, "Your account name cannot be used in a cloak directly. "
+		                                       "To ensure uniqueness, a number was added.");
+
+	MOWGLI_ITER_FOREACH(n, mu->logins.head)
+		(void) user_sethost(nicksvs.me->me, n->data, newhost);
+}
+
+static void
+nsdc_change_vhost(struct myuser *const restrict mu, const char *const restrict newhost, const bool invalidchar,
+                  const struct setter *const restrict setter)
+{
 	if (setter)
 	{
 		(void) command_success_nodata(setter->si, _("Assigned default cloak to \2%s\2."), entity(mu)->name);
@@ -137,22 +487,45 @@ nsdc_change_vhost(struct myuser *const restrict mu, const char *const restrict n
 				                              entity(mu)->name);
 		}
 
-		(void) metadata_add(mu, "private:usercloak-assigner", get_source_name(setter->si));
 		(void) logcommand(setter->si, CMDLOG_ADMIN, "DEFAULTCLOAK: \2%s\2", entity(mu)->name);
 	}
 
-	(void) snprintf(timestring, sizeof timestring, "%lu", (unsigned long) time(NULL));
-	(void) metadata_add(mu, "private:usercloak-timestamp", timestring);
-	(void) metadata_add(mu, "private:usercloak", newhost);
+	(void) nsdc_apply_cloak(mu, newhost, invalidchar, setter ? get_source_name(setter->si) : NULL);
+}
 
-	(void) myuser_notice(nicksvs.nick, mu, "You have been given a default user cloak.");
+/* Determines whether changing the cloak of an account requires FORCE because of marks. Without
+ * a source (in background jobs, where the requester need not be online), only MARK itself is
+ * looked at, as the needforce hooks are free to assume a real one.
+ */
+static void
+nsdc_check_marks(struct sourceinfo *const restrict si, struct myuser *const restrict mu,
+                 struct setter *const restrict setter)
+{
+	const struct metadata *md;
 
-	if (invalidchar)
-		(void) myuser_notice(nicksvs.nick, mu, "Your account name cannot be used in a cloak directly. "
-		                                       "To ensure uniqueness, a number was added.");
+	if ((md = metadata_find(mu, "private:mark:setter")))
+	{
+		setter->marker = md->value;
+		setter->needs_force = true;
+	}
+	else if (! si)
+	{
+		setter->marker = NULL;
+		setter->needs_force = false;
+	}
+	else
+	{
+		struct hook_user_needforce needforce_hdata = {
+			.si         = si,
+			.mu         = mu,
+			.allowed    = 1,
+		};
 
-	MOWGLI_ITER_FOREACH(n, mu->logins.head)
-		(void) user_sethost(nicksvs.me->me, n->data, newhost);
+		(void) hook_call_user_needforce(&needforce_hdata);
+
+		setter->marker = NULL;
+		setter->needs_force = !needforce_hdata.allowed;
+	}
 }
 
 static void
@@ -162,11 +535,321 @@ nsdc_user_verify_register(struct hook_user_req *const restrict req)
 		return;
 
 	char newhost[HOSTLEN + 1];
-	const bool cloaktype = nsdc_build_cloak(entity(req->mu)->name, newhost, sizeof newhost);
+	const bool cloaktype = nsdc_default_cloak(req->mu, newhost, sizeof newhost);
 
 	(void) nsdc_change_vhost(req->mu, newhost, cloaktype, NULL);
 }
 
+static void
+nsdc_job_free(struct nsdc_job *const restrict job)
+{
+	if (job->timer)
+		(void) mowgli_timer_destroy(base_eventloop, job->timer);
+
+	for (size_t i = 0; i < job->count; i++)
+		(void) free(job->ids[i]);
+
+	(void) free(job->ids);
+	(void) free(job->requester);
+	(void) free(job->assigner);
+	(void) free(job->name);
+	(void) free(job->pattern);
+	(void) free(job->old_prefix);
+	(void) free(job);
+}
+
+static void
+nsdc_job_notice(const struct nsdc_job *const restrict job, const char *const restrict fmt, ...)
+{
+	struct myuser *mu;
+	char buf[BUFSIZE];
+	va_list ap;
+
+	if (! job->requester || ! (mu = myuser_find_uid(job->requester)))
+		return;
+
+	va_start(ap, fmt);
+	(void) vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+
+	(void) myuser_notice(nicksvs.nick, mu, "%s", buf);
+}
+
+/* Whether a cloak is what an account name would have been given with an old prefix,
+ * possibly with a suffix added to avoid a collision. As in nsdc_default_cloak(), the
+ * suffix replaces the end of a cloak that was already as long as it may be.
+ */
+static bool
+nsdc_is_old_default(const char *const restrict cloak, const char *const restrict accname,
+                    const char *const restrict old_prefix, const uint32_t old_iv)
+{
+	char oldhost[HOSTLEN + 1];
+
+	(void) nsdc_build_cloak_as(old_prefix, old_iv, accname, oldhost, sizeof oldhost);
+
+	if (strcasecmp(cloak, oldhost) == 0)
+		return true;
+
+	const char *const suffix = strrchr(cloak, '-');
+
+	// Collision suffixes are -2, -3, ...
+	if (! suffix || suffix[1] < '1' || suffix[1] > '9' || strcmp(suffix, "-1") == 0 ||
+	    strspn(suffix + 1, "0123456789") != strlen(suffix + 1))
+		return false;
+
+	const size_t suffixlen = strlen(suffix);
+	const size_t baselen = MIN(strlen(oldhost), HOSTLEN - suffixlen);
+
+	return (size_t) (suffix - cloak) == baselen && strncasecmp(cloak, oldhost, baselen) == 0;
+}
+
+// Applies the same checks as a single DEFAULTCLOAK to an account, and changes its cloak if they pass
+static void
+nsdc_job_consider(struct nsdc_job *const restrict job, struct myuser *const restrict mu)
+{
+	char newhost[HOSTLEN + 1];
+	const struct metadata *md;
+	struct setter setter = {
+		.si             = NULL,
+	};
+
+	if (job->pattern && match(job->pattern, entity(mu)->name) != 0)
+		return;
+
+	md = metadata_find(mu, "private:usercloak");
+
+	// Someone else may have changed the cloak since
+	if (job->old_prefix && ! (md && nsdc_is_old_default(md->value, entity(mu)->name, job->old_prefix,
+	                                                     job->old_iv)))
+		return;
+
+	job->matched++;
+
+	const bool cloaktype = nsdc_default_cloak(mu, newhost, sizeof newhost);
+
+	if (md && strcmp(md->value, newhost) == 0)
+	{
+		job->unchanged++;
+		return;
+	}
+
+	if (job->requester && strcmp(entity(mu)->id, job->requester) == 0 && ! job->force)
+	{
+		job->skipped_self++;
+		return;
+	}
+
+	(void) nsdc_check_marks(NULL, mu, &setter);
+
+	if (setter.needs_force)
+	{
+		if (! job->can_override)
+		{
+			job->skipped_marked++;
+			return;
+		}
+
+		job->overridden++;
+	}
+
+	job->changed++;
+
+	if (! job->dryrun)
+		(void) nsdc_apply_cloak(mu, newhost, cloaktype, job->assigner);
+}
+
+static void
+nsdc_job_tick(void *const restrict vjob)
+{
+	struct nsdc_job *const job = vjob;
+	struct myuser *mu;
+
+	// A one-shot timer, freed by the event loop once we return; re-armed below while there is work left
+	job->timer = NULL;
+
+	for (unsigned int n = 0; n < nsdc_job_batch && job->next < job->count; n++, job->next++)
+	{
+		// Looked up again, as the account may have been dropped in the meantime
+		if ((mu = myuser_find_uid(job->ids[job->next])))
+			(void) nsdc_job_consider(job, mu);
+		else
+			job->vanished++;
+	}
+
+	if (job->next < job->count)
+	{
+		if (++job->ticks % NSDC_JOB_PROGRESS == 0)
+			(void) nsdc_job_notice(job, "DEFAULTCLOAK %s: %zu of %zu accounts processed.",
+			                       job->name, job->next, job->count);
+
+		job->timer = mowgli_timer_add_once(base_eventloop, "nsdc_job_tick", &nsdc_job_tick, job, 1);
+		return;
+	}
+
+	if (job->dryrun)
+		(void) nsdc_job_notice(job, "DEFAULTCLOAK %s (dry run) finished: %u accounts matched, %u would be "
+		                            "given a new default cloak, %u already have it.", job->name, job->matched,
+		                            job->changed, job->unchanged);
+	else
+		(void) nsdc_job_notice(job, "DEFAULTCLOAK %s finished: %u accounts matched, %u changed, %u already "
+		                            "had the default cloak, %u dropped.", job->name, job->matched,
+		                            job->changed, job->unchanged, job->vanished);
+
+	if (job->skipped_marked)
+		(void) nsdc_job_notice(job, "Skipped %u marked accounts; add FORCE to override this restriction.",
+		                       job->skipped_marked);
+	if (job->skipped_self)
+		(void) nsdc_job_notice(job, "Skipped your own account; add FORCE to include it.");
+
+	if (! job->dryrun)
+	{
+		if (job->overridden)
+			(void) wallops("\2%s\2 reset vhosts of %u \2MARKED\2 accounts (DEFAULTCLOAK %s).",
+			               job->assigner, job->overridden, job->name);
+
+		(void) slog(LG_INFO, "DEFAULTCLOAK: \2%s\2 by \2%s\2 finished: %u changed, %u unchanged, "
+		                     "%u dropped, %u marked skipped, %u marked overridden", job->name, job->assigner,
+		                     job->changed, job->unchanged, job->vanished, job->skipped_marked,
+		                     job->overridden);
+	}
+
+	(void) nsdc_job_free(job);
+	nsdc_job = NULL;
+}
+
+static bool
+nsdc_job_busy(struct sourceinfo *const restrict si)
+{
+	if (! nsdc_job)
+		return false;
+
+	(void) command_fail(si, fault_toomany, _("A DEFAULTCLOAK %s job is still running (%zu of %zu accounts "
+	                                         "processed)."), nsdc_job->name, nsdc_job->next, nsdc_job->count);
+	return true;
+}
+
+// Starts a job over the accounts in ids, taking over the entity IDs in it
+static void
+nsdc_job_start(struct sourceinfo *const restrict si, mowgli_list_t *const restrict ids,
+               const char *const restrict name, const char *const restrict pattern,
+               const char *const restrict old_prefix, const bool force, const bool dryrun)
+{
+	mowgli_node_t *n, *tn;
+
+	if (! MOWGLI_LIST_LENGTH(ids))
+	{
+		(void) logcommand(si, CMDLOG_ADMIN, "DEFAULTCLOAK: \2%s\2 (no matches)", name);
+		(void) command_success_nodata(si, _("DEFAULTCLOAK %s: no accounts matched."), name);
+		return;
+	}
+
+	struct nsdc_job *const job = smalloc(sizeof *job);
+
+	job->requester = si->smu ? sstrdup(entity(si->smu)->id) : NULL;
+	job->assigner = sstrdup(get_source_name(si));
+	job->name = sstrdup(name);
+	job->pattern = pattern ? sstrdup(pattern) : NULL;
+	job->old_prefix = old_prefix ? sstrdup(old_prefix) : NULL;
+	job->old_iv = old_prefix ? nsdc_calc_hash_iv(old_prefix) : 0;
+	job->force = force;
+	job->can_override = force && has_priv(si, PRIV_MARK);
+	job->dryrun = dryrun;
+	job->count = MOWGLI_LIST_LENGTH(ids);
+	job->ids = smalloc(job->count * sizeof *job->ids);
+
+	size_t i = 0;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ids->head)
+	{
+		job->ids[i++] = n->data;
+		(void) mowgli_node_delete(n, ids);
+		(void) mowgli_node_free(n);
+	}
+
+	if (job->can_override && ! dryrun)
+		(void) wallops("\2%s\2 is resetting vhosts with DEFAULTCLOAK %s FORCE; \2MARKED\2 accounts will be "
+		               "included.", get_oper_name(si), name);
+
+	(void) logcommand(si, CMDLOG_ADMIN, "DEFAULTCLOAK: \2%s\2 (\2%zu\2 candidates%s%s)", name, job->count,
+	                                    force ? ", FORCE" : "", dryrun ? ", dry run" : "");
+
+	(void) command_success_nodata(si, _("DEFAULTCLOAK %s: checking \2%zu\2 accounts in batches of %u per "
+	                                    "second; you will be notified when this is done."), name, job->count,
+	                                    nsdc_job_batch);
+
+	nsdc_job = job;
+	job->timer = mowgli_timer_add_once(base_eventloop, "nsdc_job_tick", &nsdc_job_tick, job, 1);
+}
+
+// Only the account names are looked at here; the rest is left to the job, a batch at a time
+static void
+nsdc_cmd_mask(struct sourceinfo *const restrict si, const char *const restrict pattern, const bool force,
+              const bool dryrun)
+{
+	struct myentity_iteration_state state;
+	mowgli_list_t ids = { NULL, NULL, 0 };
+	struct myentity *mt;
+	char name[BUFSIZE];
+
+	if (nsdc_job_busy(si))
+		return;
+
+	MYENTITY_FOREACH_T(mt, &state, ENT_USER)
+	{
+		if (match(pattern, mt->name) == 0)
+			(void) mowgli_node_add(sstrdup(mt->id), mowgli_node_create(), &ids);
+	}
+
+	(void) snprintf(name, sizeof name, "MASK %s", pattern);
+	(void) nsdc_job_start(si, &ids, name, pattern, NULL, force, dryrun);
+}
+
+/* Finds accounts whose cloak may still be the default built with an old prefix. Every
+ * account is walked, as the cloak index holds only one account for cloaks that collide;
+ * whether the cloak really is the old default is left to the job.
+ */
+static void
+nsdc_cmd_migrate(struct sourceinfo *const restrict si, const char *const restrict old_prefix, const bool force,
+                 const bool dryrun)
+{
+	struct myentity_iteration_state state;
+	const size_t old_len = strlen(old_prefix);
+	mowgli_list_t ids = { NULL, NULL, 0 };
+	const struct metadata *md;
+	struct myentity *mt;
+	char name[BUFSIZE];
+
+	if (nsdc_job_busy(si))
+		return;
+
+	if (old_len > (HOSTLEN / 2) || strchr(old_prefix, ' '))
+	{
+		(void) command_fail(si, fault_badparams, _("\2%s\2 is not a valid cloak prefix."), old_prefix);
+		return;
+	}
+
+	if (strcmp(old_prefix, hash_iv_prefix) == 0)
+	{
+		(void) command_fail(si, fault_badparams, _("\2%s\2 is the current default cloak prefix."), old_prefix);
+		return;
+	}
+
+	MYENTITY_FOREACH_T(mt, &state, ENT_USER)
+	{
+		if ((md = metadata_find(user(mt), "private:usercloak")) && strncasecmp(md->value, old_prefix, old_len) == 0)
+			(void) mowgli_node_add(sstrdup(mt->id), mowgli_node_create(), &ids);
+	}
+
+	(void) snprintf(name, sizeof name, "MIGRATE %s", old_prefix);
+	(void) nsdc_job_start(si, &ids, name, NULL, old_prefix, force, dryrun);
+}
+
+static void
+nsdc_myuser_delete(struct myuser *const restrict mu)
+{
+	(void) nsdc_index_remove(mu);
+}
+
 static void
 ns_cmd_defaultcloak_func(struct sourceinfo *const restrict si, const int parc, char **const restrict parv)
 {
@@ -186,6 +869,59 @@ ns_cmd_defaultcloak_func(struct sourceinfo *const restrict si, const int parc, c
 	{
 		(void) command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "DEFAULTCLOAK");
 		(void) command_fail(si, fault_needmoreparams, _("Syntax: DEFAULTCLOAK <account> [FORCE|SHOW]"));
+		(void) command_fail(si, fault_needmoreparams, _("Syntax: DEFAULTCLOAK MASK <pattern> [FORCE] [DRYRUN]"));
+		(void) command_fail(si, fault_needmoreparams, _("Syntax: DEFAULTCLOAK MIGRATE <old-prefix> [FORCE] "
+		                                                "[DRYRUN]"));
+		(void) command_fail(si, fault_needmoreparams, _("Syntax: DEFAULTCLOAK CHECK"));
+
+		return;
+	}
+
+	if (strcasecmp(parv[0], "CHECK") == 0 && ! parv[1])
+	{
+		// Rebuilt rather than trusted, as other modules may have changed cloaks behind our back
+		const unsigned int collisions = nsdc_index_build(si);
+
+		(void) logcommand(si, CMDLOG_ADMIN, "DEFAULTCLOAK:CHECK: \2%u\2 collisions", collisions);
+
+		if (collisions)
+			(void) command_success_nodata(si, ngettext(N_("\2%u\2 cloak collision found."),
+			                                           N_("\2%u\2 cloak collisions found."),
+			                                           collisions), collisions);
+		else
+			(void) command_success_nodata(si, _("No cloak collisions found."));
+
+		return;
+	}
+
+	if ((strcasecmp(parv[0], "MASK") == 0 || strcasecmp(parv[0], "MIGRATE") == 0) && parv[1])
+	{
+		const bool migrate = (strcasecmp(parv[0], "MIGRATE") == 0);
+		bool dryrun = false;
+
+		for (int i = 2; i < parc; i++)
+		{
+			if (strcasecmp(parv[i], "FORCE") == 0)
+				force = true;
+			else if (strcasecmp(parv[i], "DRYRUN") == 0)
+				dryrun = true;
+			else
+			{
+				(void) command_fail(si, fault_badparams, _("Invalid keyword \2%s\2."), parv[i]);
+				if (migrate)
+					(void) command_fail(si, fault_badparams, _("Syntax: DEFAULTCLOAK MIGRATE "
+					                                           "<old-prefix> [FORCE] [DRYRUN]"));
+				else
+					(void) command_fail(si, fault_badparams, _("Syntax: DEFAULTCLOAK MASK <pattern> "
+					                                           "[FORCE] [DRYRUN]"));
+				return;
+			}
+		}
+
+		if (migrate)
+			(void) nsdc_cmd_migrate(si, parv[1], force, dryrun);
+		else
+			(void) nsdc_cmd_mask(si, parv[1], force, dryrun);
 
 		return;
 	}
@@ -197,7 +933,7 @@ ns_cmd_defaultcloak_func(struct sourceinfo *const restrict si, const int parc, c
 		return;
 	}
 
-	const bool cloaktype = nsdc_build_cloak(entity(mu)->name, newhost, sizeof newhost);
+	const bool cloaktype = nsdc_default_cloak(mu, newhost, sizeof newhost);
 
 	if (parv[1])
 	{
@@ -236,23 +972,7 @@ ns_cmd_defaultcloak_func(struct sourceinfo *const restrict si, const int parc, c
 	}
 
 	// Check if force is required due to marks
-	if ((md = metadata_find(mu, "private:mark:setter")))
-	{
-		setter.marker = md->value;
-		setter.needs_force = true;
-	}
-	else
-	{
-		struct hook_user_needforce needforce_hdata = {
-			.si         = si,
-			.mu         = mu,
-			.allowed    = 1,
-		};
-
-		(void) hook_call_user_needforce(&needforce_hdata);
-
-		setter.needs_force = !needforce_hdata.allowed;
-	}
+	(void) nsdc_check_marks(si, mu, &setter);
 
 	// Check permissions and force if required due to marks
 	if (setter.needs_force)
@@ -299,7 +1019,7 @@ static struct command ns_cmd_defaultcloak = {
 	.name           = "DEFAULTCLOAK",
 	.desc           = N_("Resets cloaks to default."),
 	.access         = PRIV_USER_VHOST,
-	.maxparc        = 2,
+	.maxparc        = 4,
 	.cmd            = &ns_cmd_defaultcloak_func,
 	.help           = { .path = "nickserv/defaultcloak" },
 };
@@ -309,10 +1029,20 @@ mod_init(struct module *const restrict m)
 {
 	MODULE_TRY_REQUEST_DEPENDENCY(m, "nickserv/vhost");
 
+	(void) add_bool_conf_item("AUTODEFAULTCLOAK", &nicksvs.me->conf_table, 0, &nsdc_autocloak, true);
+	(void) add_dupstr_conf_item("DEFAULTCLOAK_DIGIT_LEAD", &nicksvs.me->conf_table, 0, &nsdc_digit_lead, "-");
+	(void) add_uint_conf_item("DEFAULTCLOAK_HASH_WIDTH", &nicksvs.me->conf_table, 0, &nsdc_hash_width, 3, 9, 5);
+	(void) add_dupstr_conf_item("DEFAULTCLOAK_PREFIX", &nicksvs.me->conf_table, 0, &nsdc_prefix, CLOAK_PREFIX);
+	(void) add_uint_conf_item("DEFAULTCLOAK_JOB_BATCH", &nicksvs.me->conf_table, 0, &nsdc_job_batch, 1, 10000,
+	                          100);
+	(void) hook_add_config_ready(&nsdc_config_ready);
+
 	(void) nsdc_init_hash();
+	(void) nsdc_check_digit_lead();
+	(void) nsdc_init_chartab();
 
-	(void) add_bool_conf_item("AUTODEFAULTCLOAK", &nicksvs.me->conf_table, 0, &nsdc_autocloak, true);
 	(void) hook_add_user_verify_register(&nsdc_user_verify_register);
+	(void) hook_add_myuser_delete(&nsdc_myuser_delete);
 	(void) service_named_bind_command("nickserv", &ns_cmd_defaultcloak);
 }
 
@@ -320,8 +1050,27 @@ static void
 mod_deinit(const enum module_unload_intent ATHEME_VATTR_UNUSED intent)
 {
 	(void) del_conf_item("AUTODEFAULTCLOAK", &nicksvs.me->conf_table);
+	(void) del_conf_item("DEFAULTCLOAK_DIGIT_LEAD", &nicksvs.me->conf_table);
+	(void) del_conf_item("DEFAULTCLOAK_HASH_WIDTH", &nicksvs.me->conf_table);
+	(void) del_conf_item("DEFAULTCLOAK_PREFIX", &nicksvs.me->conf_table);
+	(void) del_conf_item("DEFAULTCLOAK_JOB_BATCH", &nicksvs.me->conf_table);
+	(void) hook_del_config_ready(&nsdc_config_ready);
 	(void) hook_del_user_verify_register(&nsdc_user_verify_register);
+	(void) hook_del_myuser_delete(&nsdc_myuser_delete);
 	(void) service_named_unbind_command("nickserv", &ns_cmd_defaultcloak);
+
+	if (nsdc_job)
+	{
+		(void) slog(LG_INFO, "DEFAULTCLOAK: \2%s\2 aborted by module unload after %zu of %zu accounts",
+		                     nsdc_job->name, nsdc_job->next, nsdc_job->count);
+		(void) nsdc_job_free(nsdc_job);
+		nsdc_job = NULL;
+	}
+
+	if (nsdc_cloaks)
+		(void) mowgli_patricia_destroy(nsdc_cloaks, &nsdc_index_free, NULL);
+
+	(void) free(hash_iv_prefix);
 }
 
 SIMPLE_DECLARE_MODULE_V1("freenode/ns_defaultcloak", MODULE_UNLOAD_CAPABILITY_OK)
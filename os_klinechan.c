@@ -8,56 +8,533 @@
  */
 
 #include "atheme.h"
+#include "klinechan.h"
+#include "chanmask.h"
+
+#define KLINECHAN_MASKS_STORAGE	"contrib/os_klinechan:masks"
+#define KLINECHAN_MASK_STATS_STORAGE	"contrib/os_klinechan:maskstats"
+
+static struct service *operserv = NULL;
+
+struct klinechan
+{
+	struct mychan *mc;      /* NULL for channel masks */
+	char *mask;             /* NULL for registered channels */
+	char *setter;
+	char *reason;
+	time_t ts;
+
+	unsigned int klines;    /* klines issued because of this klinechan */
+	unsigned int joins;     /* joins by users not already klined */
+	unsigned int exempt;    /* of which by exempt users or staff */
+	time_t last_hit;        /* last time any such join happened */
+};
+
+/* Channels with automatic klines enabled, keyed by channel name, so that the
+ * join hook and LISTKLINECHAN need not look at every channel. Each record is
+ * also attached to its channel as privatedata, and saved to the database as
+ * KLC and KLCS rows.
+ */
+static mowgli_patricia_t *klinechans = NULL;
+static bool klinechans_loaded = false;
 
 static void
-klinechan_check_join(struct hook_channel_joinpart *hdata)
+klinechan_free(const char *key, void *data, void *privdata)
+{
+	struct klinechan *kc = data;
+
+	free(kc->mask);
+	free(kc->setter);
+	free(kc->reason);
+	free(kc);
+}
+
+static struct klinechan *
+klinechan_add(struct mychan *mc, const char *setter, const char *reason, time_t ts)
+{
+	struct klinechan *kc = smalloc(sizeof *kc);
+
+	kc->mc = mc;
+	kc->mask = NULL;
+	kc->setter = sstrdup(setter);
+	kc->reason = sstrdup(reason);
+	kc->ts = ts;
+	kc->klines = 0;
+	kc->joins = 0;
+	kc->exempt = 0;
+	kc->last_hit = 0;
+
+	mowgli_patricia_add(klinechans, mc->name, kc);
+	privatedata_set(mc, KLINECHAN_PRIVDATA, kc);
+	return kc;
+}
+
+static void
+klinechan_delete(struct mychan *mc)
+{
+	struct klinechan *kc;
+
+	if (!(kc = privatedata_delete(mc, KLINECHAN_PRIVDATA)))
+		return;
+
+	mowgli_patricia_delete(klinechans, mc->name);
+	klinechan_free(NULL, kc, NULL);
+}
+
+/* Channel masks with automatic klines enabled, keyed by mask. These may match
+ * unregistered channels, so they are kept in the database on their own, as
+ * KLM and KLMS rows.
+ */
+static mowgli_patricia_t *klinechan_masks = NULL;
+
+/* The masks above, compiled for the join hook */
+static struct
+{
+	struct chanmask_set set;
+	bool stale;
+} mask_matcher = { .stale = true };
+
+static const char *
+klinechan_name(const struct klinechan *kc)
+{
+	return kc->mc != NULL ? kc->mc->name : kc->mask;
+}
+
+static void
+klinechan_masks_clear(void)
+{
+	chanmask_set_clear(&mask_matcher.set);
+	mask_matcher.stale = true;
+}
+
+static void
+klinechan_masks_compile(void)
+{
+	mowgli_patricia_iteration_state_t state;
+	struct klinechan *kc;
+
+	klinechan_masks_clear();
+	chanmask_set_init(&mask_matcher.set, NULL);
+	mask_matcher.stale = false;
+
+	MOWGLI_PATRICIA_FOREACH(kc, &state, klinechan_masks)
+		chanmask_set_add(&mask_matcher.set, kc->mask, kc);
+}
+
+static struct klinechan *
+klinechan_mask_match(const char *name)
+{
+	if (mask_matcher.stale)
+		klinechan_masks_compile();
+
+	return chanmask_set_match(&mask_matcher.set, name);
+}
+
+static void
+klinechan_mask_add(const char *mask, const char *setter, const char *reason, time_t ts)
+{
+	struct klinechan *kc = smalloc(sizeof *kc);
+
+	kc->mc = NULL;
+	kc->mask = sstrdup(mask);
+	kc->setter = sstrdup(setter);
+	kc->reason = sstrdup(reason);
+	kc->ts = ts;
+	kc->klines = 0;
+	kc->joins = 0;
+	kc->exempt = 0;
+	kc->last_hit = 0;
+
+	mowgli_patricia_add(klinechan_masks, kc->mask, kc);
+	mask_matcher.stale = true;
+}
+
+/* Refuse masks like "#*" that would match most of the network */
+static bool
+klinechan_mask_valid(const char *mask)
+{
+	unsigned int literals = 0;
+
+	if (mask[0] != '#' || strlen(mask) > CHANNELLEN)
+		return false;
+
+	for (const char *c = mask + 1; *c != '\0'; c++)
+		if (*c != '*' && *c != '?')
+			literals++;
+
+	return literals >= 3;
+}
+
+/* Converts klinechans still stored as channel metadata, either by older
+ * versions of this module or by mod_deinit() below, into records.
+ */
+static void
+klinechan_migrate_metadata(struct mychan *mc)
 {
+	struct metadata *md;
+	const char *setter, *reason;
+	struct klinechan *kc;
+	time_t ts;
+
+	if (!(md = metadata_find(mc, "private:klinechan:closer")))
+		return;
+
+	if (!privatedata_get(mc, KLINECHAN_PRIVDATA))
+	{
+		setter = md->value;
+		md = metadata_find(mc, "private:klinechan:reason");
+		reason = md != NULL ? md->value : "unknown";
+		md = metadata_find(mc, "private:klinechan:timestamp");
+		ts = md != NULL ? atol(md->value) : 0;
+
+		kc = klinechan_add(mc, setter, reason, ts);
+
+		if ((md = metadata_find(mc, "private:klinechan:klines")) != NULL)
+			kc->klines = strtoul(md->value, NULL, 10);
+		if ((md = metadata_find(mc, "private:klinechan:lasthit")) != NULL)
+			kc->last_hit = atol(md->value);
+		if ((md = metadata_find(mc, "private:klinechan:joins")) != NULL)
+			kc->joins = strtoul(md->value, NULL, 10);
+		if ((md = metadata_find(mc, "private:klinechan:exempt")) != NULL)
+			kc->exempt = strtoul(md->value, NULL, 10);
+	}
+
+	metadata_delete(mc, "private:klinechan:closer");
+	metadata_delete(mc, "private:klinechan:reason");
+	metadata_delete(mc, "private:klinechan:timestamp");
+	metadata_delete(mc, "private:klinechan:klines");
+	metadata_delete(mc, "private:klinechan:lasthit");
+	metadata_delete(mc, "private:klinechan:joins");
+	metadata_delete(mc, "private:klinechan:exempt");
+}
+
+static mowgli_patricia_t *
+klinechan_index(void)
+{
+	mowgli_patricia_iteration_state_t state;
 	struct mychan *mc;
-	struct chanuser *cu = hdata->cu;
-	struct service *svs;
-	const char *khost;
-	struct kline *k;
 
-	svs = service_find("operserv");
-	if (svs == NULL)
+	/* legacy metadata is only complete once the database has been loaded,
+	 * which is after module init, so migrate it on first use
+	 */
+	if (klinechans_loaded)
+		return klinechans;
+
+	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+		klinechan_migrate_metadata(mc);
+
+	klinechans_loaded = true;
+	return klinechans;
+}
+
+bool
+klinechan_covers(const char *name)
+{
+	struct mychan *mc;
+
+	if (mowgli_patricia_retrieve(klinechan_index(), name) != NULL)
+		return true;
+
+	if (mowgli_patricia_size(klinechan_masks) == 0 || klinechan_mask_match(name) == NULL)
+		return false;
+
+	/* channels that may not be closed are not klined either */
+	return !((mc = mychan_find(name)) != NULL && (mc->flags & CHAN_LOG));
+}
+
+static void
+klinechan_db_write(struct database_handle *db)
+{
+	mowgli_patricia_iteration_state_t state;
+	struct klinechan *kc;
+
+	MOWGLI_PATRICIA_FOREACH(kc, &state, klinechan_index())
+	{
+		db_start_row(db, "KLC");
+		db_write_word(db, kc->mc->name);
+		db_write_word(db, kc->setter);
+		db_write_time(db, kc->ts);
+		db_write_str(db, kc->reason);
+		db_commit_row(db);
+
+		db_start_row(db, "KLCS");
+		db_write_word(db, kc->mc->name);
+		db_write_uint(db, kc->klines);
+		db_write_time(db, kc->last_hit);
+		db_write_uint(db, kc->joins);
+		db_write_uint(db, kc->exempt);
+		db_commit_row(db);
+	}
+
+	MOWGLI_PATRICIA_FOREACH(kc, &state, klinechan_masks)
+	{
+		db_start_row(db, "KLM");
+		db_write_word(db, kc->mask);
+		db_write_word(db, kc->setter);
+		db_write_time(db, kc->ts);
+		db_write_str(db, kc->reason);
+		db_commit_row(db);
+
+		db_start_row(db, "KLMS");
+		db_write_word(db, kc->mask);
+		db_write_uint(db, kc->klines);
+		db_write_time(db, kc->last_hit);
+		db_write_uint(db, kc->joins);
+		db_write_uint(db, kc->exempt);
+		db_commit_row(db);
+	}
+}
+
+static void
+klinechan_db_h_klm(struct database_handle *db, const char *type)
+{
+	const char *mask = db_sread_word(db);
+	const char *setter = db_sread_word(db);
+	time_t ts = db_sread_time(db);
+	const char *reason = db_sread_str(db);
+
+	if (mowgli_patricia_retrieve(klinechan_masks, mask))
 		return;
 
-	if (cu == NULL || is_internal_client(cu->user))
+	klinechan_mask_add(mask, setter, reason, ts);
+}
+
+static void
+klinechan_db_h_klms(struct database_handle *db, const char *type)
+{
+	const char *mask = db_sread_word(db);
+	unsigned int klines = db_sread_uint(db);
+	time_t last_hit = db_sread_time(db);
+	unsigned int joins = db_sread_uint(db);
+	unsigned int exempt = db_sread_uint(db);
+	struct klinechan *kc;
+
+	if (!(kc = mowgli_patricia_retrieve(klinechan_masks, mask)))
 		return;
 
-	if (!(mc = mychan_from(cu->chan)))
+	kc->klines = klines;
+	kc->last_hit = last_hit;
+	kc->joins = joins;
+	kc->exempt = exempt;
+}
+
+static void
+klinechan_db_h_klc(struct database_handle *db, const char *type)
+{
+	const char *name = db_sread_word(db);
+	const char *setter = db_sread_word(db);
+	time_t ts = db_sread_time(db);
+	const char *reason = db_sread_str(db);
+	struct mychan *mc;
+
+	if (!(mc = mychan_find(name)))
+	{
+		slog(LG_INFO, "klinechan_db_h_klc(): discarding klinechan record for unregistered channel %s", name);
 		return;
+	}
 
-	/* If they've already been sent a kline, do nothing */
-	if (cu->user->flags & UF_KLINESENT)
+	if (privatedata_get(mc, KLINECHAN_PRIVDATA))
 		return;
 
-	if (metadata_find(mc, "private:klinechan:closer"))
+	klinechan_add(mc, setter, reason, ts);
+}
+
+static void
+klinechan_db_h_klcs(struct database_handle *db, const char *type)
+{
+	const char *name = db_sread_word(db);
+	unsigned int klines = db_sread_uint(db);
+	time_t last_hit = db_sread_time(db);
+	struct mychan *mc;
+	struct klinechan *kc;
+
+	if (!(mc = mychan_find(name)) || !(kc = privatedata_get(mc, KLINECHAN_PRIVDATA)))
+		return;
+
+	kc->klines = klines;
+	kc->last_hit = last_hit;
+
+	/* added later, so optional */
+	(void) db_read_uint(db, &kc->joins);
+	(void) db_read_uint(db, &kc->exempt);
+}
+
+/* Hosts (or networks) klined recently, so that a flood of clients from one
+ * place results in a single kline rather than one per client.
+ */
+struct recent_kline
+{
+	char *host;
+	time_t expires;
+};
+
+static mowgli_patricia_t *recent_klines = NULL;
+static mowgli_eventloop_timer_t *recent_klines_timer = NULL;
+
+static unsigned int kline_dedupe_time;
+static unsigned int klinechan_expire_time;
+static mowgli_eventloop_timer_t *klinechan_expire_timer = NULL;
+static unsigned int kline_ipv4_cidr;
+static unsigned int kline_ipv6_cidr;
+
+static void
+recent_kline_free(const char *key, void *data, void *privdata)
+{
+	struct recent_kline *rk = data;
+
+	free(rk->host);
+	free(rk);
+}
+
+static void
+recent_klines_expire(void *unused)
+{
+	mowgli_patricia_iteration_state_t state;
+	struct recent_kline *rk;
+
+	MOWGLI_PATRICIA_FOREACH(rk, &state, recent_klines)
 	{
-		khost = cu->user->ip ? cu->user->ip : cu->user->host;
-		if (has_priv_user(cu->user, PRIV_JOIN_STAFFONLY))
-			notice(svs->me->nick, cu->user->nick,
-					"Warning: %s klines normal users",
-					cu->chan->name);
-		else if (is_autokline_exempt(cu->user))
+		if (rk->expires <= CURRTIME)
 		{
-			char buf[BUFSIZE];
-			snprintf(buf, sizeof(buf), "Not klining *@%s due to klinechan %s (user %s!%s@%s is exempt)",
-					khost, cu->chan->name,
-					cu->user->nick, cu->user->user, cu->user->host);
-			wallops_sts(buf);
+			mowgli_patricia_delete(recent_klines, rk->host);
+			recent_kline_free(NULL, rk, NULL);
 		}
-		else
+	}
+}
+
+/* Widens an IP address to the configured CIDR block for its address family.
+ * Returns the host unchanged if it is not an IP address or no aggregation is
+ * configured for its family.
+ */
+static const char *
+klinechan_kline_host(const char *host, char *buf, size_t bufsize)
+{
+	unsigned char addr[16];
+	char addrbuf[INET6_ADDRSTRLEN];
+	unsigned int bits, len, i;
+	int af;
+
+	if (inet_pton(AF_INET, host, addr) == 1)
+	{
+		af = AF_INET;
+		len = 4;
+		bits = kline_ipv4_cidr;
+	}
+	else if (inet_pton(AF_INET6, host, addr) == 1)
+	{
+		af = AF_INET6;
+		len = 16;
+		bits = kline_ipv6_cidr;
+	}
+	else
+		return host;
+
+	if (bits == 0 || bits >= len * 8)
+		return host;
+
+	for (i = 0; i < len; i++)
+	{
+		if (i * 8 >= bits)
+			addr[i] = 0;
+		else if (i * 8 + 8 > bits)
+			addr[i] &= 0xFF << (8 - (bits - i * 8));
+	}
+
+	if (!inet_ntop(af, addr, addrbuf, sizeof addrbuf))
+		return host;
+
+	/* a leading colon would be taken for the start of the trailing parameter */
+	snprintf(buf, bufsize, "%s%s/%u", addrbuf[0] == ':' ? "0" : "", addrbuf, bits);
+	return buf;
+}
+
+static void
+klinechan_check_join(struct hook_channel_joinpart *hdata)
+{
+	struct klinechan *kc;
+	struct chanuser *cu = hdata->cu;
+	const char *khost;
+	char cidrbuf[BUFSIZE];
+	struct recent_kline *rk;
+	struct kline *k;
+
+	/* If they've already been sent a kline, do nothing */
+	if (cu == NULL || (cu->user->flags & UF_KLINESENT))
+		return;
+
+	/* nearly every join is to a channel that is not on autokline */
+	kc = NULL;
+	if (mowgli_patricia_size(klinechan_index()) != 0)
+		kc = mowgli_patricia_retrieve(klinechans, cu->chan->name);
+
+	if (kc == NULL && mowgli_patricia_size(klinechan_masks) != 0)
+	{
+		struct mychan *mc;
+
+		if (!(kc = klinechan_mask_match(cu->chan->name)))
+			return;
+
+		/* channels that may not be closed may not be klined either */
+		if ((mc = mychan_from(cu->chan)) != NULL && (mc->flags & CHAN_LOG))
+			return;
+	}
+
+	if (kc == NULL)
+		return;
+
+	if (is_internal_client(cu->user))
+		return;
+
+	kc->joins++;
+	kc->last_hit = CURRTIME;
+
+	khost = cu->user->ip ? cu->user->ip : cu->user->host;
+	if (has_priv_user(cu->user, PRIV_JOIN_STAFFONLY))
+	{
+		kc->exempt++;
+		notice(operserv->me->nick, cu->user->nick,
+				"Warning: %s klines normal users",
+				cu->chan->name);
+	}
+	else if (is_autokline_exempt(cu->user))
+	{
+		char buf[BUFSIZE];
+
+		kc->exempt++;
+		snprintf(buf, sizeof(buf), "Not klining *@%s due to klinechan %s (user %s!%s@%s is exempt)",
+				khost, cu->chan->name,
+				cu->user->nick, cu->user->user, cu->user->host);
+		wallops_sts(buf);
+	}
+	else
+	{
+		if (cu->user->ip)
+			khost = klinechan_kline_host(khost, cidrbuf, sizeof cidrbuf);
+
+		cu->user->flags |= UF_KLINESENT;
+
+		/* already covered by a kline we sent moments ago */
+		rk = mowgli_patricia_retrieve(recent_klines, khost);
+		if (rk != NULL && rk->expires > CURRTIME)
+			return;
+
+		slog(LG_INFO, "klinechan_check_join(): klining \2*@%s\2 (user \2%s!%s@%s\2 joined \2%s\2)",
+				khost, cu->user->nick,
+				cu->user->user, cu->user->host,
+				cu->chan->name);
+
+		k = kline_add("*", khost, kc->reason, config_options.kline_time, "*");
+		kc->klines++;
+
+		if (kline_dedupe_time)
 		{
-		        struct metadata* md = metadata_find(mc, "private:klinechan:reason");
-		        const char *reason = md != NULL ? md->value : "unknown";
-			slog(LG_INFO, "klinechan_check_join(): klining \2*@%s\2 (user \2%s!%s@%s\2 joined \2%s\2)",
-					khost, cu->user->nick,
-					cu->user->user, cu->user->host,
-					cu->chan->name);
-
-			k = kline_add("*", khost, reason, config_options.kline_time, "*");
-			cu->user->flags |= UF_KLINESENT;
+			if (rk == NULL)
+			{
+				rk = smalloc(sizeof *rk);
+				rk->host = sstrdup(khost);
+				mowgli_patricia_add(recent_klines, rk->host, rk);
+			}
+			rk->expires = CURRTIME + kline_dedupe_time;
 		}
 	}
 }
@@ -65,27 +542,86 @@ klinechan_check_join(struct hook_channel_joinpart *hdata)
 static void
 klinechan_show_info(struct hook_channel_req *hdata)
 {
-	struct metadata *md;
-	const char *setter, *reason;
-	time_t ts;
+	struct klinechan *kc;
 	struct tm tm;
 	char strfbuf[BUFSIZE];
 
 	if (!has_priv(hdata->si, PRIV_CHAN_AUSPEX))
 		return;
-	md = metadata_find(hdata->mc, "private:klinechan:closer");
-	if (md == NULL)
+
+	klinechan_index();
+	if (!(kc = privatedata_get(hdata->mc, KLINECHAN_PRIVDATA)))
 		return;
-	setter = md->value;
-	md = metadata_find(hdata->mc, "private:klinechan:reason");
-	reason = md != NULL ? md->value : "unknown";
-	md = metadata_find(hdata->mc, "private:klinechan:timestamp");
-	ts = md != NULL ? atoi(md->value) : 0;
 
-	tm = *localtime(&ts);
+	tm = *localtime(&kc->ts);
 	strftime(strfbuf, sizeof strfbuf, TIME_FORMAT, &tm);
 
-	command_success_nodata(hdata->si, "%s had \2automatic klines\2 enabled on it by %s on %s (%s)", hdata->mc->name, setter, strfbuf, reason);
+	command_success_nodata(hdata->si, "%s had \2automatic klines\2 enabled on it by %s on %s (%s)", hdata->mc->name, kc->setter, strfbuf, kc->reason);
+
+	if (kc->last_hit)
+	{
+		tm = *localtime(&kc->last_hit);
+		strftime(strfbuf, sizeof strfbuf, TIME_FORMAT, &tm);
+
+		command_success_nodata(hdata->si, "%s has caught %u joins (%u exempt) and caused %u klines, last triggered on %s",
+				hdata->mc->name, kc->joins, kc->exempt, kc->klines, strfbuf);
+	}
+	else
+		command_success_nodata(hdata->si, "%s has not been triggered yet", hdata->mc->name);
+}
+
+static void
+klinechan_set_mask(struct sourceinfo *si, const char *target, const char *action, const char *reason)
+{
+	struct klinechan *kc;
+
+	if (!strcasecmp(action, "ON"))
+	{
+		if (!reason)
+		{
+			command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "KLINECHAN");
+			command_fail(si, fault_needmoreparams, "Usage: KLINECHAN <#channel|mask> ON <reason>");
+			return;
+		}
+
+		if (!klinechan_mask_valid(target))
+		{
+			command_fail(si, fault_badparams, "\2%s\2 is not a valid channel mask, or matches too many channels.", target);
+			return;
+		}
+
+		if (mowgli_patricia_retrieve(klinechan_masks, target))
+		{
+			command_fail(si, fault_nochange, "\2%s\2 is already on autokline.", target);
+			return;
+		}
+
+		klinechan_mask_add(target, si->su->nick, reason, CURRTIME);
+
+		wallops("%s enabled automatic klines on channels matching \2%s\2 (%s).", get_oper_name(si), target, reason);
+		logcommand(si, CMDLOG_ADMIN, "KLINECHAN:ON: \2%s\2 (reason: \2%s\2)", target, reason);
+		command_success_nodata(si, "Klining all users joining channels matching \2%s\2.", target);
+	}
+	else if (!strcasecmp(action, "OFF"))
+	{
+		if (!(kc = mowgli_patricia_delete(klinechan_masks, target)))
+		{
+			command_fail(si, fault_nochange, "\2%s\2 is not closed.", target);
+			return;
+		}
+
+		klinechan_free(NULL, kc, NULL);
+		mask_matcher.stale = true;
+
+		wallops("%s disabled automatic klines on channels matching \2%s\2.", get_oper_name(si), target);
+		logcommand(si, CMDLOG_ADMIN, "KLINECHAN:OFF: \2%s\2", target);
+		command_success_nodata(si, "No longer klining users joining channels matching \2%s\2.", target);
+	}
+	else
+	{
+		command_fail(si, fault_badparams, STR_INVALID_PARAMS, "KLINECHAN");
+		command_fail(si, fault_badparams, "Usage: KLINECHAN <#channel|mask> <ON|OFF> [reason]");
+	}
 }
 
 static void
@@ -99,7 +635,13 @@ os_cmd_klinechan(struct sourceinfo *si, int parc, char *parv[])
 	if (!target || !action)
 	{
 		command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "KLINECHAN");
-		command_fail(si, fault_needmoreparams, "Usage: KLINECHAN <#channel> <ON|OFF> [reason]");
+		command_fail(si, fault_needmoreparams, "Usage: KLINECHAN <#channel|mask> <ON|OFF> [reason]");
+		return;
+	}
+
+	if (strpbrk(target, "*?"))
+	{
+		klinechan_set_mask(si, target, action, reason);
 		return;
 	}
 
@@ -114,7 +656,7 @@ os_cmd_klinechan(struct sourceinfo *si, int parc, char *parv[])
 		if (!reason)
 		{
 			command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "KLINECHAN");
-			command_fail(si, fault_needmoreparams, "Usage: KLINECHAN <#channel> ON <reason>");
+			command_fail(si, fault_needmoreparams, "Usage: KLINECHAN <#channel|mask> ON <reason>");
 			return;
 		}
 
@@ -124,15 +666,14 @@ os_cmd_klinechan(struct sourceinfo *si, int parc, char *parv[])
 			return;
 		}
 
-		if (metadata_find(mc, "private:klinechan:closer"))
+		klinechan_index();
+		if (privatedata_get(mc, KLINECHAN_PRIVDATA))
 		{
 			command_fail(si, fault_nochange, "\2%s\2 is already on autokline.", target);
 			return;
 		}
 
-		metadata_add(mc, "private:klinechan:closer", si->su->nick);
-		metadata_add(mc, "private:klinechan:reason", reason);
-		metadata_add(mc, "private:klinechan:timestamp", number_to_string(CURRTIME));
+		klinechan_add(mc, si->su->nick, reason, CURRTIME);
 
 		wallops("%s enabled automatic klines on the channel \2%s\2 (%s).", get_oper_name(si), target, reason);
 		logcommand(si, CMDLOG_ADMIN, "KLINECHAN:ON: \2%s\2 (reason: \2%s\2)", target, reason);
@@ -140,15 +681,14 @@ os_cmd_klinechan(struct sourceinfo *si, int parc, char *parv[])
 	}
 	else if (!strcasecmp(action, "OFF"))
 	{
-		if (!metadata_find(mc, "private:klinechan:closer"))
+		klinechan_index();
+		if (!privatedata_get(mc, KLINECHAN_PRIVDATA))
 		{
 			command_fail(si, fault_nochange, "\2%s\2 is not closed.", target);
 			return;
 		}
 
-		metadata_delete(mc, "private:klinechan:closer");
-		metadata_delete(mc, "private:klinechan:reason");
-		metadata_delete(mc, "private:klinechan:timestamp");
+		klinechan_delete(mc);
 
 		wallops("%s disabled automatic klines on the channel \2%s\2.", get_oper_name(si), target);
 		logcommand(si, CMDLOG_ADMIN, "KLINECHAN:OFF: \2%s\2", target);
@@ -157,29 +697,103 @@ os_cmd_klinechan(struct sourceinfo *si, int parc, char *parv[])
 	else
 	{
 		command_fail(si, fault_badparams, STR_INVALID_PARAMS, "KLINECHAN");
-		command_fail(si, fault_badparams, "Usage: KLINECHAN <#channel> <ON|OFF> [reason]");
+		command_fail(si, fault_badparams, "Usage: KLINECHAN <#channel|mask> <ON|OFF> [reason]");
 	}
 }
 
+/* Disables klinechans that have not been triggered (or, if they never were,
+ * set) for KLINECHAN_EXPIRE, so that stale ones do not accumulate.
+ */
+static void
+klinechan_expire_idle(void *unused)
+{
+	mowgli_patricia_iteration_state_t state;
+	struct klinechan *kc;
+	time_t cutoff;
+
+	if (!klinechan_expire_time)
+		return;
+
+	cutoff = CURRTIME - klinechan_expire_time;
+
+	MOWGLI_PATRICIA_FOREACH(kc, &state, klinechan_index())
+	{
+		if (kc->ts >= cutoff || kc->last_hit >= cutoff)
+			continue;
+
+		slog(LG_INFO, "KLINECHAN:EXPIRE: \2%s\2 (set by \2%s\2, %u klines)", kc->mc->name, kc->setter, kc->klines);
+		wallops("Automatic klines on the channel \2%s\2 have been disabled after being idle.", kc->mc->name);
+		klinechan_delete(kc->mc);
+	}
+
+	MOWGLI_PATRICIA_FOREACH(kc, &state, klinechan_masks)
+	{
+		if (kc->ts >= cutoff || kc->last_hit >= cutoff)
+			continue;
+
+		slog(LG_INFO, "KLINECHAN:EXPIRE: \2%s\2 (set by \2%s\2, %u klines)", kc->mask, kc->setter, kc->klines);
+		wallops("Automatic klines on channels matching \2%s\2 have been disabled after being idle.", kc->mask);
+		mowgli_patricia_delete(klinechan_masks, kc->mask);
+		klinechan_free(NULL, kc, NULL);
+		mask_matcher.stale = true;
+	}
+}
+
+static void
+klinechan_list_entry(struct sourceinfo *si, const struct klinechan *kc)
+{
+	struct tm tm;
+	char setbuf[BUFSIZE], hitbuf[BUFSIZE];
+
+	tm = *localtime(&kc->ts);
+	strftime(setbuf, sizeof setbuf, TIME_FORMAT, &tm);
+
+	if (kc->last_hit)
+	{
+		tm = *localtime(&kc->last_hit);
+		strftime(hitbuf, sizeof hitbuf, TIME_FORMAT, &tm);
+	}
+	else
+		mowgli_strlcpy(hitbuf, "never", sizeof hitbuf);
+
+	command_success_nodata(si, "- %-30s %s on %s (%s)%s", klinechan_name(kc), kc->setter, setbuf, kc->reason,
+			kc->mask != NULL ? " [mask]" : "");
+	command_success_nodata(si, "  %u joins, %u exempt, %u klines, last triggered: %s", kc->joins, kc->exempt, kc->klines, hitbuf);
+}
+
 static void
 os_cmd_listklinechans(struct sourceinfo *si, int parc, char *parv[])
 {
 	const char *pattern;
 	mowgli_patricia_iteration_state_t state;
-	struct mychan *mc;
-	struct metadata *md;
+	struct klinechan *kc;
 	unsigned int matches = 0;
+	size_t prefixlen;
 
 	pattern = parc >= 1 ? parv[0] : "*";
 
-	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+	/* This still visits every klinechan, but the pattern's literal prefix
+	 * is a cheap way to rule most of them out before calling match().
+	 */
+	prefixlen = strcspn(pattern, "*?\\");
+
+	MOWGLI_PATRICIA_FOREACH(kc, &state, klinechan_index())
 	{
-		md = metadata_find(mc, "private:klinechan:closer");
-		if (md == NULL)
+		if (prefixlen && ircncasecmp(kc->mc->name, pattern, prefixlen))
 			continue;
-		if (!match(pattern, mc->name))
+
+		if (!match(pattern, kc->mc->name))
 		{
-			command_success_nodata(si, "- %-30s", mc->name);
+			klinechan_list_entry(si, kc);
+			matches++;
+		}
+	}
+
+	MOWGLI_PATRICIA_FOREACH(kc, &state, klinechan_masks)
+	{
+		if (!match(pattern, kc->mask))
+		{
+			klinechan_list_entry(si, kc);
 			matches++;
 		}
 	}
@@ -193,6 +807,12 @@ os_cmd_listklinechans(struct sourceinfo *si, int parc, char *parv[])
 						    N_("\2%u\2 matches for pattern \2%s\2"), matches), matches, pattern);
 }
 
+static void
+klinechan_drop(struct mychan *mc)
+{
+	klinechan_delete(mc);
+}
+
 static struct command os_klinechan = {
 	.name           = "KLINECHAN",
 	.desc           = N_("Klines all users joining a channel for the duration set by SET KLINETIME."),
@@ -211,14 +831,147 @@ static struct command os_listklinechans = {
 	.help           = { .path = "contrib/listklinechans" },
 };
 
+/* The records do not survive the module being unloaded. Put klinechans back
+ * into channel metadata, where klinechan_index() picks them up again (and
+ * where they are saved even if the module is not loaded again), and keep the
+ * masks in global storage for a reload.
+ */
+static void
+klinechan_stash(void)
+{
+	mowgli_patricia_iteration_state_t state;
+	struct klinechan *kc;
+	mowgli_list_t *masks, *stats;
+	char buf[BUFSIZE];
+
+	MOWGLI_PATRICIA_FOREACH(kc, &state, klinechan_index())
+	{
+		metadata_add(kc->mc, "private:klinechan:closer", kc->setter);
+		metadata_add(kc->mc, "private:klinechan:reason", kc->reason);
+		metadata_add(kc->mc, "private:klinechan:timestamp", number_to_string(kc->ts));
+		metadata_add(kc->mc, "private:klinechan:klines", number_to_string(kc->klines));
+		metadata_add(kc->mc, "private:klinechan:lasthit", number_to_string(kc->last_hit));
+		metadata_add(kc->mc, "private:klinechan:joins", number_to_string(kc->joins));
+		metadata_add(kc->mc, "private:klinechan:exempt", number_to_string(kc->exempt));
+
+		privatedata_delete(kc->mc, KLINECHAN_PRIVDATA);
+	}
+
+	/* the counters are kept apart, like KLMS rows, so that either list
+	 * still makes sense to a version of this module that lacks the other
+	 */
+	masks = mowgli_list_create();
+	stats = mowgli_list_create();
+	MOWGLI_PATRICIA_FOREACH(kc, &state, klinechan_masks)
+	{
+		snprintf(buf, sizeof buf, "%s %s %lu %s", kc->mask, kc->setter, (unsigned long)kc->ts, kc->reason);
+		mowgli_node_add(sstrdup(buf), mowgli_node_create(), masks);
+
+		snprintf(buf, sizeof buf, "%s %u %lu %u %u", kc->mask, kc->klines, (unsigned long)kc->last_hit,
+		         kc->joins, kc->exempt);
+		mowgli_node_add(sstrdup(buf), mowgli_node_create(), stats);
+	}
+
+	mowgli_global_storage_put(KLINECHAN_MASKS_STORAGE, masks);
+	mowgli_global_storage_put(KLINECHAN_MASK_STATS_STORAGE, stats);
+}
+
+static void
+klinechan_restore_masks(void)
+{
+	mowgli_list_t *masks;
+	mowgli_node_t *n, *tn;
+	char *mask, *setter, *ts, *reason, *saveptr;
+
+	if (!(masks = mowgli_global_storage_get(KLINECHAN_MASKS_STORAGE)))
+		return;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, masks->head)
+	{
+		mask = strtok_r(n->data, " ", &saveptr);
+		setter = strtok_r(NULL, " ", &saveptr);
+		ts = strtok_r(NULL, " ", &saveptr);
+		reason = strtok_r(NULL, "", &saveptr);
+
+		if (reason != NULL && !mowgli_patricia_retrieve(klinechan_masks, mask))
+			klinechan_mask_add(mask, setter, reason, atol(ts));
+
+		free(n->data);
+		mowgli_node_delete(n, masks);
+		mowgli_node_free(n);
+	}
+
+	mowgli_list_free(masks);
+	mowgli_global_storage_free(KLINECHAN_MASKS_STORAGE);
+
+	if (!(masks = mowgli_global_storage_get(KLINECHAN_MASK_STATS_STORAGE)))
+		return;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, masks->head)
+	{
+		struct klinechan *kc;
+		unsigned int klines, joins, exempt;
+		unsigned long last_hit;
+		char *counters;
+
+		mask = strtok_r(n->data, " ", &saveptr);
+		counters = strtok_r(NULL, "", &saveptr);
+
+		if (counters != NULL && (kc = mowgli_patricia_retrieve(klinechan_masks, mask)) != NULL &&
+		    sscanf(counters, "%u %lu %u %u", &klines, &last_hit, &joins, &exempt) == 4)
+		{
+			kc->klines = klines;
+			kc->last_hit = last_hit;
+			kc->joins = joins;
+			kc->exempt = exempt;
+		}
+
+		free(n->data);
+		mowgli_node_delete(n, masks);
+		mowgli_node_free(n);
+	}
+
+	mowgli_list_free(masks);
+	mowgli_global_storage_free(KLINECHAN_MASK_STATS_STORAGE);
+}
+
 static void
 mod_init(struct module *const restrict m)
 {
+	MODULE_TRY_REQUEST_DEPENDENCY(m, "operserv/main");
+
+	if (!(operserv = service_find("operserv")))
+	{
+		slog(LG_ERROR, "%s: operserv is not loaded", m->name);
+		m->mflags |= MODFLAG_FAIL;
+		return;
+	}
+
+	klinechans = mowgli_patricia_create(irccasecanon);
+	klinechan_masks = mowgli_patricia_create(irccasecanon);
+	recent_klines = mowgli_patricia_create(strcasecanon);
+	recent_klines_timer = mowgli_timer_add(base_eventloop, "recent_klines_expire", recent_klines_expire, NULL, 60);
+	klinechan_expire_timer = mowgli_timer_add(base_eventloop, "klinechan_expire_idle", klinechan_expire_idle, NULL, 3600);
+
+	add_duration_conf_item("KLINECHAN_DEDUPE_TIME", &operserv->conf_table, 0, &kline_dedupe_time, "s", 60);
+	add_duration_conf_item("KLINECHAN_EXPIRE", &operserv->conf_table, 0, &klinechan_expire_time, "d", 0);
+	add_uint_conf_item("KLINECHAN_IPV4_CIDR", &operserv->conf_table, 0, &kline_ipv4_cidr, 0, 32, 32);
+	add_uint_conf_item("KLINECHAN_IPV6_CIDR", &operserv->conf_table, 0, &kline_ipv6_cidr, 0, 128, 128);
+
 	service_named_bind_command("operserv", &os_klinechan);
 	service_named_bind_command("operserv", &os_listklinechans);
 
 	hook_add_first_channel_join(klinechan_check_join);
 	hook_add_channel_info(klinechan_show_info);
+	hook_add_channel_drop(klinechan_drop);
+	hook_add_db_write(klinechan_db_write);
+
+	db_register_type_handler("KLM", klinechan_db_h_klm);
+	db_register_type_handler("KLMS", klinechan_db_h_klms);
+	db_register_type_handler("KLC", klinechan_db_h_klc);
+	db_register_type_handler("KLCS", klinechan_db_h_klcs);
+
+	klinechan_restore_masks();
 }
 
 static void
@@ -227,8 +980,30 @@ mod_deinit(const enum module_unload_intent intent)
 	service_named_unbind_command("operserv", &os_klinechan);
 	service_named_unbind_command("operserv", &os_listklinechans);
 
-	hook_del_channel_join(klinechan_check_join);
+	hook_del_first_channel_join(klinechan_check_join);
 	hook_del_channel_info(klinechan_show_info);
+	hook_del_channel_drop(klinechan_drop);
+	hook_del_db_write(klinechan_db_write);
+
+	db_unregister_type_handler("KLM");
+	db_unregister_type_handler("KLMS");
+	db_unregister_type_handler("KLC");
+	db_unregister_type_handler("KLCS");
+
+	klinechan_stash();
+
+	del_conf_item("KLINECHAN_DEDUPE_TIME", &operserv->conf_table);
+	del_conf_item("KLINECHAN_EXPIRE", &operserv->conf_table);
+	del_conf_item("KLINECHAN_IPV4_CIDR", &operserv->conf_table);
+	del_conf_item("KLINECHAN_IPV6_CIDR", &operserv->conf_table);
+
+	mowgli_timer_destroy(base_eventloop, recent_klines_timer);
+	mowgli_timer_destroy(base_eventloop, klinechan_expire_timer);
+
+	mowgli_patricia_destroy(klinechans, klinechan_free, NULL);
+	klinechan_masks_clear();
+	mowgli_patricia_destroy(klinechan_masks, klinechan_free, NULL);
+	mowgli_patricia_destroy(recent_klines, recent_kline_free, NULL);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/os_klinechan", MODULE_UNLOAD_CAPABILITY_OK)
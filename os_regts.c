@@ -12,6 +12,516 @@ static void os_cmd_regts(sourceinfo_t *si, int parc, char *parv[]);
 
 command_t os_regts = { "REGTS", N_("Adjusts registration timestamps."), PRIV_ADMIN, 3, os_cmd_regts, { .path = "freenode/os_regts" } };
 
+#define REGTS_BATCH_MAX_LINES 100000U
+#define REGTS_BATCH_MAX_ERRORS 10U
+#define REGTS_BATCH_SLICE 200U
+
+enum regts_type {
+	REGTS_USER,
+	REGTS_NICK,
+	REGTS_CHANNEL,
+};
+
+struct regts_batch_entry {
+	enum regts_type type;
+	char *target;
+	time_t ts;
+	unsigned int line;
+};
+
+struct regts_batch {
+	char *file;
+	char *oper;       // for logs and the final wallops
+	char *requester;  // entity ID of the requesting account
+	struct regts_batch_entry *entries;
+	size_t count, next;
+	unsigned int adjusted[3], unchanged, skipped, nicks_affected, logins;
+	mowgli_eventloop_timer_t *timer;
+};
+
+static struct regts_batch *regts_batch;
+
+// Entity IDs of accounts whose logins still need to be re-sent; flushed shortly after the first is queued
+static mowgli_patricia_t *regts_resync;
+static mowgli_eventloop_timer_t *regts_resync_timer;
+
+static bool
+regts_parse_type(const char *type, enum regts_type *out)
+{
+	if (!strcasecmp(type, "USER"))
+		*out = REGTS_USER;
+	else if (!strcasecmp(type, "NICK"))
+		*out = REGTS_NICK;
+	else if (!strcasecmp(type, "CHANNEL"))
+		*out = REGTS_CHANNEL;
+	else
+		return false;
+
+	return true;
+}
+
+static bool
+regts_parse_ts(const char *ts_str, time_t *out)
+{
+	char *end;
+	errno = 0;
+	*out = strtol(ts_str, &end, 10);
+
+	return !*end && errno != ERANGE && *out >= 0;
+}
+
+/*
+ * As per nickserv/set_accountname we have precedent for handling re-login
+ * as a logout followed immediately by a login. See os_cmd_regts() for why
+ * we bother at all.
+ */
+static unsigned int
+regts_resend_logins(myuser_t *mu, bool *killed)
+{
+	mowgli_node_t *n, *tn;
+	unsigned int logins = 0;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, mu->logins.head)
+	{
+		user_t *u = n->data;
+
+		slog(LG_VERBOSE, "regts_resend_logins(): ts for account %s changed, resending login data for user %s", entity(mu)->name, u->nick);
+		logins++;
+
+		if (! ircd_on_logout(u, entity(mu)->name) )
+		{
+			ircd_on_login(u, mu, NULL);
+		}
+		else
+		{
+			*killed = true;
+		}
+	}
+
+	return logins;
+}
+
+/*
+ * The charybdis family, including ircd-seven and solanum, is only told the
+ * account name, so there is nothing to re-send. Any other protocol may carry
+ * the registration timestamp, so logins are re-sent unless we know better.
+ */
+static bool
+regts_protocol_uses_account_ts(void)
+{
+	static const char *const family[] = { "charybdis", "ircd-seven", "solanum", NULL };
+
+	if (ircd->type == PROTOCOL_CHARYBDIS || ircd->type == PROTOCOL_SHADOWIRCD)
+		return false;
+
+	// Protocol modules of the family need not all use its protocol type
+	for (size_t i = 0; family[i]; i++)
+		if (!strncasecmp(ircd->ircdname, family[i], strlen(family[i])))
+			return false;
+
+	return true;
+}
+
+static void
+regts_resync_free(const char *key, void *data, void *privdata)
+{
+	free(data);
+}
+
+static void
+regts_resync_flush(void *unused)
+{
+	mowgli_patricia_iteration_state_t state;
+	unsigned int accounts = 0, logins = 0;
+	bool killed = false;
+	char *id;
+
+	regts_resync_timer = NULL;
+
+	MOWGLI_PATRICIA_FOREACH(id, &state, regts_resync)
+	{
+		// accounts may have been dropped in the meantime
+		myuser_t *mu = myuser_find_uid(id);
+
+		if (!mu)
+			continue;
+
+		accounts++;
+		logins += regts_resend_logins(mu, &killed);
+	}
+
+	mowgli_patricia_destroy(regts_resync, regts_resync_free, NULL);
+	regts_resync = NULL;
+
+	if (logins)
+		slog(LG_INFO, "regts_resync_flush(): re-sent %u logins for %u accounts%s", logins, accounts, killed ? "; some users had to be disconnected" : "");
+}
+
+/*
+ * Queues the logins of an account to be re-sent, so that several changes to the
+ * same account in quick succession (as in a batch) only cause one re-send.
+ * Returns how many sessions will be affected.
+ */
+static unsigned int
+regts_queue_resync(myuser_t *mu)
+{
+	if (!regts_protocol_uses_account_ts() || !MOWGLI_LIST_LENGTH(&mu->logins))
+		return 0;
+
+	if (!regts_resync)
+		regts_resync = mowgli_patricia_create(NULL);
+
+	if (!mowgli_patricia_retrieve(regts_resync, entity(mu)->id))
+		mowgli_patricia_add(regts_resync, entity(mu)->id, sstrdup(entity(mu)->id));
+
+	if (!regts_resync_timer)
+		regts_resync_timer = mowgli_timer_add_once(base_eventloop, "regts_resync_flush", regts_resync_flush, NULL, 1);
+
+	return MOWGLI_LIST_LENGTH(&mu->logins);
+}
+
+static void
+regts_batch_free(struct regts_batch *batch)
+{
+	if (batch->timer)
+		mowgli_timer_destroy(base_eventloop, batch->timer);
+
+	for (size_t i = 0; i < batch->count; i++)
+		free(batch->entries[i].target);
+
+	free(batch->entries);
+	free(batch->file);
+	free(batch->oper);
+	free(batch->requester);
+	free(batch);
+}
+
+static void
+regts_batch_notice(struct regts_batch *batch, const char *fmt, ...)
+{
+	myuser_t *mu;
+	char buf[BUFSIZE];
+	va_list ap;
+
+	if (!batch->requester || !(mu = myuser_find_uid(batch->requester)))
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+
+	service_t *svs = service_find("operserv");
+	myuser_notice(svs ? svs->nick : me.name, mu, "%s", buf);
+}
+
+// Targets are looked up again, as they may have been dropped since the batch was validated
+static void
+regts_batch_apply(struct regts_batch *batch, const struct regts_batch_entry *e)
+{
+	if (e->type == REGTS_USER)
+	{
+		myuser_t *mu = myuser_find(e->target);
+		mowgli_node_t *n;
+
+		if (!mu)
+		{
+			batch->skipped++;
+			return;
+		}
+
+		if (mu->registered == e->ts)
+		{
+			batch->unchanged++;
+			return;
+		}
+
+		MOWGLI_ITER_FOREACH(n, mu->nicks.head)
+		{
+			mynick_t *mn = n->data;
+			if (mn->registered < e->ts)
+			{
+				slog(LG_CMD_ADMIN, "%s REGTS:BATCH:NICK: \2%s\2 \2%ld\2 -> \2%ld\2 (adjusting to match account \2%s\2)", batch->oper, mn->nick, mn->registered, e->ts, entity(mu)->name);
+				mn->registered = e->ts;
+				batch->nicks_affected++;
+			}
+		}
+
+		slog(LG_CMD_ADMIN, "%s REGTS:BATCH:USER: \2%s\2 \2%ld\2 -> \2%ld\2", batch->oper, entity(mu)->name, mu->registered, e->ts);
+		mu->registered = e->ts;
+
+		batch->logins += regts_queue_resync(mu);
+	}
+	else if (e->type == REGTS_NICK)
+	{
+		mynick_t *mn = mynick_find(e->target);
+
+		if (!mn || mn->owner->registered > e->ts)
+		{
+			batch->skipped++;
+			return;
+		}
+
+		if (mn->registered == e->ts)
+		{
+			batch->unchanged++;
+			return;
+		}
+
+		slog(LG_CMD_ADMIN, "%s REGTS:BATCH:NICK: \2%s\2 \2%ld\2 -> \2%ld\2 (account \2%s\2)", batch->oper, mn->nick, mn->registered, e->ts, entity(mn->owner)->name);
+		mn->registered = e->ts;
+	}
+	else
+	{
+		mychan_t *mc = mychan_find(e->target);
+
+		if (!mc)
+		{
+			batch->skipped++;
+			return;
+		}
+
+		if (mc->registered == e->ts)
+		{
+			batch->unchanged++;
+			return;
+		}
+
+		slog(LG_CMD_ADMIN, "%s REGTS:BATCH:CHANNEL: \2%s\2 \2%ld\2 -> \2%ld\2", batch->oper, mc->name, mc->registered, e->ts);
+		mc->registered = e->ts;
+	}
+
+	batch->adjusted[e->type]++;
+}
+
+static void
+regts_batch_tick(void *arg)
+{
+	struct regts_batch *batch = arg;
+
+	// A one-shot timer, freed by the event loop once we return; re-armed below while there is work left
+	batch->timer = NULL;
+
+	for (unsigned int i = 0; i < REGTS_BATCH_SLICE && batch->next < batch->count; i++)
+		regts_batch_apply(batch, &batch->entries[batch->next++]);
+
+	if (batch->next < batch->count)
+	{
+		batch->timer = mowgli_timer_add_once(base_eventloop, "regts_batch_tick", regts_batch_tick, batch, 1);
+		return;
+	}
+
+	wallops("%s adjusted registration timestamps from \2%s\2: %u accounts (and %u of their nicks), %u nicks, %u channels; %u unchanged, %u skipped",
+			batch->oper, batch->file, batch->adjusted[REGTS_USER], batch->nicks_affected, batch->adjusted[REGTS_NICK],
+			batch->adjusted[REGTS_CHANNEL], batch->unchanged, batch->skipped);
+	regts_batch_notice(batch, "REGTS BATCH %s finished: %u accounts, %u nicks and %u channels adjusted, %u unchanged, %u skipped. %u logins will be re-sent, which may disconnect users if the ircd cannot update them.",
+			batch->file, batch->adjusted[REGTS_USER], batch->adjusted[REGTS_NICK], batch->adjusted[REGTS_CHANNEL],
+			batch->unchanged, batch->skipped, batch->logins);
+
+	regts_batch_free(batch);
+	regts_batch = NULL;
+}
+
+static bool
+regts_batch_error(sourceinfo_t *si, unsigned int *errors, unsigned int line, const char *fmt, ...)
+{
+	char buf[BUFSIZE];
+	va_list ap;
+
+	if (++*errors > REGTS_BATCH_MAX_ERRORS)
+		return false;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+
+	command_fail(si, fault_badparams, _("Line %u: %s"), line, buf);
+	return false;
+}
+
+// Checks a single line against the current state; checks involving other lines are done later
+static bool
+regts_batch_check(sourceinfo_t *si, unsigned int *errors, mowgli_patricia_t **seen, struct regts_batch_entry *e)
+{
+	if (e->ts > CURRTIME)
+		return regts_batch_error(si, errors, e->line, _("timestamp for \2%s\2 is in the future."), e->target);
+
+	if (mowgli_patricia_retrieve(seen[e->type], e->target))
+		return regts_batch_error(si, errors, e->line, _("\2%s\2 is listed more than once."), e->target);
+
+	if ((e->type == REGTS_USER && !myuser_find(e->target)) ||
+	    (e->type == REGTS_NICK && !mynick_find(e->target)) ||
+	    (e->type == REGTS_CHANNEL && !mychan_find(e->target)))
+		return regts_batch_error(si, errors, e->line, _("\2%s\2 is not registered."), e->target);
+
+	mowgli_patricia_add(seen[e->type], e->target, e);
+	return true;
+}
+
+static void
+regts_cmd_batch(sourceinfo_t *si, const char *file)
+{
+	if (regts_batch)
+	{
+		command_fail(si, fault_toomany, _("A REGTS batch from \2%s\2 is still being applied (%zu of %zu done)."), regts_batch->file, regts_batch->next, regts_batch->count);
+		return;
+	}
+
+	// Batch files are read from the data directory and may not name anything outside it
+	if (file[0] == '.' || file[strspn(file, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-")] != '\0')
+	{
+		command_fail(si, fault_badparams, _("Batch files must be given as a plain file name in the services data directory."));
+		return;
+	}
+
+	char path[BUFSIZE];
+	snprintf(path, sizeof path, "%s/%s", DATADIR, file);
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		command_fail(si, fault_nosuch_target, _("Could not open \2%s\2: %s"), file, strerror(errno));
+		return;
+	}
+
+	mowgli_list_t lines = { NULL, NULL, 0 };
+	mowgli_patricia_t *seen[3] = {
+		mowgli_patricia_create(irccasecanon),
+		mowgli_patricia_create(irccasecanon),
+		mowgli_patricia_create(irccasecanon),
+	};
+	unsigned int errors = 0, lineno = 0;
+	char buf[BUFSIZE];
+	mowgli_node_t *n, *tn;
+
+	while (fgets(buf, sizeof buf, f))
+	{
+		char *type, *target, *ts_str, *extra, *save;
+		size_t len = strlen(buf);
+
+		if (++lineno > REGTS_BATCH_MAX_LINES)
+		{
+			regts_batch_error(si, &errors, lineno, _("batch files may have at most %u lines."), REGTS_BATCH_MAX_LINES);
+			break;
+		}
+
+		// fgets() returns the rest of an overlong line as another line, which must not be parsed on its own
+		if (len && buf[len - 1] != '\n' && !feof(f))
+		{
+			int c;
+
+			regts_batch_error(si, &errors, lineno, _("line is too long."));
+
+			while ((c = getc(f)) != EOF && c != '\n')
+				;
+
+			continue;
+		}
+
+		if (!(type = strtok_r(buf, " \t\r\n", &save)) || *type == '#')
+			continue;
+
+		target = strtok_r(NULL, " \t\r\n", &save);
+		ts_str = target ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+		extra = ts_str ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+
+		struct regts_batch_entry *e = smalloc(sizeof *e);
+		e->line = lineno;
+
+		if (!ts_str || extra || !regts_parse_type(type, &e->type))
+			regts_batch_error(si, &errors, lineno, _("expected \2USER|NICK|CHANNEL <target> <timestamp>\2."));
+		else if (!regts_parse_ts(ts_str, &e->ts))
+			regts_batch_error(si, &errors, lineno, _("\2%s\2 is not a valid UNIX timestamp."), ts_str);
+		else
+		{
+			e->target = sstrdup(target);
+			if (regts_batch_check(si, &errors, seen, e))
+			{
+				mowgli_node_add(e, mowgli_node_create(), &lines);
+				continue;
+			}
+			free(e->target);
+		}
+
+		free(e);
+	}
+
+	if (ferror(f))
+		regts_batch_error(si, &errors, lineno, _("read error: %s"), strerror(errno));
+
+	fclose(f);
+
+	// A nick may not end up older than its account, taking account changes from the same batch into account
+	MOWGLI_ITER_FOREACH(n, lines.head)
+	{
+		struct regts_batch_entry *e = n->data, *owner_e;
+		mynick_t *mn;
+
+		if (e->type != REGTS_NICK || !(mn = mynick_find(e->target)))
+			continue;
+
+		owner_e = mowgli_patricia_retrieve(seen[REGTS_USER], entity(mn->owner)->name);
+
+		if ((owner_e ? owner_e->ts : mn->owner->registered) > e->ts)
+			regts_batch_error(si, &errors, e->line, _("nick \2%s\2 cannot be older than its account \2%s\2."), mn->nick, entity(mn->owner)->name);
+	}
+
+	for (size_t i = 0; i < 3; i++)
+		mowgli_patricia_destroy(seen[i], NULL, NULL);
+
+	struct regts_batch *batch = NULL;
+
+	if (!errors && MOWGLI_LIST_LENGTH(&lines))
+	{
+		batch = smalloc(sizeof *batch);
+		batch->entries = smalloc(MOWGLI_LIST_LENGTH(&lines) * sizeof *batch->entries);
+
+		// Accounts go first, so that nick changes are checked against the account timestamps they will end up with
+		for (int pass = 0; pass < 2; pass++)
+			MOWGLI_ITER_FOREACH(n, lines.head)
+			{
+				struct regts_batch_entry *e = n->data;
+				if ((e->type == REGTS_USER) == (pass == 0))
+					batch->entries[batch->count++] = *e;
+			}
+	}
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, lines.head)
+	{
+		struct regts_batch_entry *e = n->data;
+
+		// ownership of the target string has moved to the batch
+		if (!batch)
+			free(e->target);
+		free(e);
+		mowgli_node_delete(n, &lines);
+		mowgli_node_free(n);
+	}
+
+	if (errors)
+	{
+		if (errors > REGTS_BATCH_MAX_ERRORS)
+			command_fail(si, fault_badparams, _("... and %u more errors."), errors - REGTS_BATCH_MAX_ERRORS);
+		command_fail(si, fault_badparams, _("\2%s\2 was not applied because of the errors above."), file);
+		return;
+	}
+
+	if (!batch)
+	{
+		command_fail(si, fault_nochange, _("\2%s\2 does not contain any timestamps."), file);
+		return;
+	}
+
+	batch->file = sstrdup(file);
+	batch->oper = sstrdup(get_oper_name(si));
+	batch->requester = si->smu ? sstrdup(entity(si->smu)->id) : NULL;
+
+	logcommand(si, CMDLOG_ADMIN, "REGTS:BATCH: \2%s\2 (\2%zu\2 entries)", file, batch->count);
+	command_success_nodata(si, _("\2%s\2 has been validated; applying %zu timestamps in the background. You will be notified when this is done."), file, batch->count);
+
+	regts_batch = batch;
+	batch->timer = mowgli_timer_add_once(base_eventloop, "regts_batch_tick", regts_batch_tick, batch, 1);
+}
+
 static void
 os_cmd_regts(sourceinfo_t *si, int parc, char *parv[])
 {
@@ -19,18 +529,23 @@ os_cmd_regts(sourceinfo_t *si, int parc, char *parv[])
 	const char *target = parv[1];
 	const char *ts_str = parv[2];
 
+	if (type && target && !ts_str && !strcasecmp(type, "BATCH"))
+	{
+		regts_cmd_batch(si, target);
+		return;
+	}
+
 	if (!ts_str)
 	{
 		command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "REGTS");
 		command_fail(si, fault_needmoreparams, _("Syntax: REGTS USER|NICK|CHANNEL <target> <timestamp>"));
+		command_fail(si, fault_needmoreparams, _("Syntax: REGTS BATCH <file>"));
 		return;
 	}
 
-	char *end;
-	errno = 0;
-	time_t newts = strtol(ts_str, &end, 10);
+	time_t newts;
 
-	if (*end || errno == ERANGE)
+	if (!regts_parse_ts(ts_str, &newts))
 	{
 		command_fail(si, fault_badparams, _("Please specify a valid UNIX timestamp."));
 		return;
@@ -59,7 +574,7 @@ os_cmd_regts(sourceinfo_t *si, int parc, char *parv[])
 		}
 
 		unsigned int nicks_affected = 0;
-		mowgli_node_t *n, *tn;
+		mowgli_node_t *n;
 		MOWGLI_ITER_FOREACH(n, mu->nicks.head)
 		{
 			mynick_t *mn = n->data;
@@ -80,52 +595,20 @@ os_cmd_regts(sourceinfo_t *si, int parc, char *parv[])
 		 * and in fact we do not send it out at all.
 		 *
 		 * Other protocols do care, and in fact we reject bursted logins if the
-		 * registration timestamp doesn't match. In case we change this for ircd-seven
-		 * or someone tries to use this with an ircd that does care, make sure
-		 * we let the ircd know about the different registration timestamp.
-		 *
-		 * As per nickserv/set_accountname we have precedent for handling re-login
-		 * as a logout followed immediately by a login. This shouldn't be strictly
-		 * necessary, but whatever.
+		 * registration timestamp doesn't match. In case someone tries to use this
+		 * with an ircd that does care, make sure we let the ircd know about the
+		 * different registration timestamp. This is queued, see regts_queue_resync().
 		 */
-		unsigned int logins = 0;
-		bool killed = false;
-
-		MOWGLI_ITER_FOREACH_SAFE(n, tn, mu->logins.head)
-		{
-			user_t *u = n->data;
-
-			slog(LG_VERBOSE, "os_cmd_regts(): ts for account %s changed, resending login data for user %s", entity(mu)->name, u->nick);
-			logins++;
-
-			if (! ircd_on_logout(u, entity(mu)->name) )
-			{
-				ircd_on_login(u, mu, NULL);
-			}
-			else
-			{
-				killed = true;
-			}
-		}
+		unsigned int logins = regts_queue_resync(mu);
 
 		command_success_nodata(si, _("The registration timestamp for the account \2%s\2 has been adjusted."), entity(mu)->name);
 
 		if (logins)
 		{
-			if (killed)
-			{
-				command_success_nodata(si, ngettext(
-							N_("To ensure consistency, %d user logged in as \2%s\2 has been disconnected."),
-							N_("To ensure consistency, %d users logged in as \2%s\2 have been disconnected."),
-							logins), logins, entity(mu)->name);
-			}
-			else
-			{
-				command_success_nodata(si, ngettext(
-							N_("To ensure consistency, %d user logged in as \2%s\2 has had their login re-applied."),
-							N_("To ensure consistency, %d users logged in as \2%s\2 have had their logins re-applied."),
-							logins), logins, entity(mu)->name);
-			}
+			command_success_nodata(si, ngettext(
+						N_("To ensure consistency, the login of %d user logged in as \2%s\2 will be re-sent; the ircd may disconnect them if it cannot update it."),
+						N_("To ensure consistency, the logins of %d users logged in as \2%s\2 will be re-sent; the ircd may disconnect them if it cannot update them."),
+						logins), logins, entity(mu)->name);
 		}
 
 		if (nicks_affected)
@@ -204,6 +687,20 @@ static void
 mod_deinit(const module_unload_intent_t unused)
 {
 	service_named_unbind_command("operserv", &os_regts);
+
+	if (regts_batch)
+	{
+		slog(LG_INFO, "REGTS:BATCH: %s aborted by module unload after %zu of %zu entries", regts_batch->file, regts_batch->next, regts_batch->count);
+		regts_batch_free(regts_batch);
+		regts_batch = NULL;
+	}
+
+	// Don't leave the ircd with stale login data
+	if (regts_resync_timer)
+	{
+		mowgli_timer_destroy(base_eventloop, regts_resync_timer);
+		regts_resync_flush(NULL);
+	}
 }
 
 DECLARE_MODULE_V1
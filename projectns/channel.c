@@ -12,14 +12,13 @@
 
 static void cmd_channel(sourceinfo_t *si, int parc, char *parv[]);
 
-command_t ps_channel = { "CHANNEL", N_("Manages project channel namespaces."), PRIV_PROJECT_ADMIN, 4, cmd_channel, { .path = "freenode/project_channel" } };
+command_t ps_channel = { "CHANNEL", N_("Manages project channel namespaces."), PRIV_PROJECT_ADMIN, 3, cmd_channel, { .path = "freenode/project_channel" } };
 
 static void cmd_channel(sourceinfo_t *si, int parc, char *parv[])
 {
 	char *project   = parv[0];
 	char *mode      = parv[1];
-	char *namespace = parv[2];
-	char *trailing  = parv[3];
+	char *targets   = parv[2];
 
 	enum {
 		CHANNS_BAD = 0,
@@ -35,15 +34,39 @@ static void cmd_channel(sourceinfo_t *si, int parc, char *parv[])
 			add_or_del = CHANNS_DEL;
 	}
 
-	if (!namespace || !add_or_del || trailing)
+	char *namespaces[PROJECTNS_MAX_BULK_TARGETS];
+	unsigned int count = 0;
+	bool too_many = false;
+
+	if (targets)
+	{
+		char *saveptr = NULL;
+		for (char *ns = strtok_r(targets, " ", &saveptr); ns; ns = strtok_r(NULL, " ", &saveptr))
+		{
+			if (count == PROJECTNS_MAX_BULK_TARGETS)
+			{
+				too_many = true;
+				break;
+			}
+			namespaces[count++] = ns;
+		}
+	}
+
+	if (!count || !add_or_del)
 	{
-		cmd_faultcode_t fault = (namespace ? fault_badparams : fault_needmoreparams);
+		cmd_faultcode_t fault = (count ? fault_badparams : fault_needmoreparams);
 
 		if (fault == fault_badparams)
 			command_fail(si, fault, STR_INVALID_PARAMS, "CHANNEL");
 		else
 			command_fail(si, fault, STR_INSUFFICIENT_PARAMS, "CHANNEL");
-		command_fail(si, fault, _("Syntax: CHANNEL <project> ADD|DEL <#namespace>"));
+		command_fail(si, fault, _("Syntax: CHANNEL <project> ADD|DEL <#namespace> [<#namespace> ...]"));
+		return;
+	}
+
+	if (too_many)
+	{
+		command_fail(si, fault_badparams, _("You may only specify up to %u namespaces at once."), PROJECTNS_MAX_BULK_TARGETS);
 		return;
 	}
 
@@ -51,20 +74,23 @@ static void cmd_channel(sourceinfo_t *si, int parc, char *parv[])
 	// as we wouldn't be able to delete them otherwise
 	if (add_or_del == CHANNS_ADD)
 	{
-		for (char *c = namespace; *c; c++)
+		for (unsigned int i = 0; i < count; i++)
 		{
-			if (!isprint(*c))
+			for (char *c = namespaces[i]; *c; c++)
 			{
-				// Don't echo it back, since non-printables might mess with the output
-				command_fail(si, fault_badparams, _("The provided channel name contains invalid characters."));
-				return;
+				if (!isprint(*c))
+				{
+					// Don't echo it back, since non-printables might mess with the output
+					command_fail(si, fault_badparams, _("The provided channel name contains invalid characters."));
+					return;
+				}
 			}
-		}
 
-		if (namespace[0] != '#' || strlen(namespace) >= CHANNELLEN)
-		{
-			command_fail(si, fault_badparams, _("\2%s\2 is not a valid channel name."), namespace);
-			return;
+			if (namespaces[i][0] != '#' || strlen(namespaces[i]) >= CHANNELLEN)
+			{
+				command_fail(si, fault_badparams, _("\2%s\2 is not a valid channel name."), namespaces[i]);
+				return;
+			}
 		}
 	}
 
@@ -76,54 +102,91 @@ static void cmd_channel(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	struct projectns *chan_p = mowgli_patricia_retrieve(projectsvs->projects_by_channelns, namespace);
-	if (chan_p && add_or_del == CHANNS_ADD)
+	// Validate every namespace before touching anything, so that either all of them
+	// are applied or none are
+	for (unsigned int i = 0; i < count; i++)
 	{
-		command_fail(si, fault_alreadyexists, _("The \2%s\2 namespace already belongs to project \2%s\2."), namespace, chan_p->name);
-		return;
-	}
-	if (!chan_p && add_or_del == CHANNS_DEL)
-	{
-		command_fail(si, fault_nochange, _("The \2%s\2 namespace is not registered to any project."), namespace);
-		return;
-	}
+		const char *namespace = namespaces[i];
 
-	if (add_or_del == CHANNS_DEL)
-	{
-		if (chan_p != p)
+		for (unsigned int j = 0; j < i; j++)
+		{
+			if (irccasecmp(namespaces[j], namespace) == 0)
+			{
+				command_fail(si, fault_badparams, _("The \2%s\2 namespace was specified more than once."), namespace);
+				return;
+			}
+		}
+
+		struct projectns *chan_p = mowgli_patricia_retrieve(projectsvs->projects_by_channelns, namespace);
+		if (chan_p && add_or_del == CHANNS_ADD)
+		{
+			command_fail(si, fault_alreadyexists, _("The \2%s\2 namespace already belongs to project \2%s\2."), namespace, chan_p->name);
+			return;
+		}
+		if (!chan_p && add_or_del == CHANNS_DEL)
+		{
+			command_fail(si, fault_nochange, _("The \2%s\2 namespace is not registered to any project."), namespace);
+			return;
+		}
+		if (chan_p && chan_p != p)
 		{
 			command_fail(si, fault_nosuch_key, _("The \2%s\2 namespace is registered to project \2%s\2, but you tried to remove it from project \2%s\2."), namespace, chan_p->name, p->name);
 			return;
 		}
+	}
 
-		mowgli_patricia_delete(projectsvs->projects_by_channelns, namespace);
+	struct projectns_summary summary = { "", 0, { NULL, NULL, 0 } };
 
-		mowgli_node_t *n, *tn;
-		MOWGLI_ITER_FOREACH_SAFE(n, tn, chan_p->channel_ns.head)
+	for (unsigned int i = 0; i < count; i++)
+	{
+		const char *namespace = namespaces[i];
+
+		if (add_or_del == CHANNS_DEL)
 		{
-			const char *ns = n->data;
-			if (irccasecmp(ns, namespace) == 0)
+			mowgli_patricia_delete(projectsvs->projects_by_channelns, namespace);
+
+			mowgli_node_t *n, *tn;
+			MOWGLI_ITER_FOREACH_SAFE(n, tn, p->channel_ns.head)
 			{
-				free(n->data);
+				const char *ns = n->data;
+				if (irccasecmp(ns, namespace) == 0)
+				{
+					free(n->data);
 
-				mowgli_node_delete(n, &chan_p->channel_ns);
-				mowgli_node_free(n);
+					mowgli_node_delete(n, &p->channel_ns);
+					mowgli_node_free(n);
 
-				break;
+					break;
+				}
 			}
 		}
+		else // CHANNS_ADD
+		{
+			/* We've checked above that this namespace isn't already registered */
+			mowgli_patricia_add(projectsvs->projects_by_channelns, namespace, p);
+			mowgli_node_add(sstrdup(namespace), mowgli_node_create(), &p->channel_ns);
+		}
 
-		logcommand(si, CMDLOG_ADMIN, "PROJECT:CHANNEL:DEL: \2%s\2 from \2%s\2", namespace, chan_p->name);
-		command_success_nodata(si, _("The namespace \2%s\2 was unregistered from project \2%s\2."), namespace, chan_p->name);
+		projectns_summary_add(&summary, namespace);
+	}
+
+	const char *list = projectns_summary_get(&summary);
+
+	if (add_or_del == CHANNS_DEL)
+	{
+		projectns_summary_log(&summary, si, "PROJECT:CHANNEL:DEL: \2%s\2 from \2%s\2", p->name);
+		if (count == 1)
+			command_success_nodata(si, _("The namespace \2%s\2 was unregistered from project \2%s\2."), list, p->name);
+		else
+			command_success_nodata(si, _("The namespaces \2%s\2 were unregistered from project \2%s\2."), list, p->name);
 	}
 	else // CHANNS_ADD
 	{
-		/* We've checked above that this namespace isn't already registered */
-		mowgli_patricia_add(projectsvs->projects_by_channelns, namespace, p);
-		mowgli_node_add(sstrdup(namespace), mowgli_node_create(), &p->channel_ns);
-
-		logcommand(si, CMDLOG_ADMIN, "PROJECT:CHANNEL:ADD: \2%s\2 to \2%s\2", namespace, p->name);
-		command_success_nodata(si, _("The namespace \2%s\2 was registered to project \2%s\2."), namespace, p->name);
+		projectns_summary_log(&summary, si, "PROJECT:CHANNEL:ADD: \2%s\2 to \2%s\2", p->name);
+		if (count == 1)
+			command_success_nodata(si, _("The namespace \2%s\2 was registered to project \2%s\2."), list, p->name);
+		else
+			command_success_nodata(si, _("The namespaces \2%s\2 were registered to project \2%s\2."), list, p->name);
 	}
 }
 
@@ -12,14 +12,13 @@
 
 static void cmd_cloak(sourceinfo_t *si, int parc, char *parv[]);
 
-command_t ps_cloak = { "CLOAK", N_("Manages project cloak namespaces."), PRIV_PROJECT_ADMIN, 4, cmd_cloak, { .path = "freenode/project_cloak" } };
+command_t ps_cloak = { "CLOAK", N_("Manages project cloak namespaces."), PRIV_PROJECT_ADMIN, 3, cmd_cloak, { .path = "freenode/project_cloak" } };
 
 static void cmd_cloak(sourceinfo_t *si, int parc, char *parv[])
 {
 	char *project   = parv[0];
 	char *mode      = parv[1];
-	char *namespace = parv[2];
-	char *trailing  = parv[3];
+	char *targets   = parv[2];
 
 	enum {
 		CLOAKNS_BAD = 0,
@@ -35,45 +34,74 @@ static void cmd_cloak(sourceinfo_t *si, int parc, char *parv[])
 			add_or_del = CLOAKNS_DEL;
 	}
 
-	if (!namespace || !add_or_del || trailing)
+	char *namespaces[PROJECTNS_MAX_BULK_TARGETS];
+	unsigned int count = 0;
+	bool too_many = false;
+
+	if (targets)
 	{
-		cmd_faultcode_t fault = (namespace ? fault_badparams : fault_needmoreparams);
+		char *saveptr = NULL;
+		for (char *ns = strtok_r(targets, " ", &saveptr); ns; ns = strtok_r(NULL, " ", &saveptr))
+		{
+			if (count == PROJECTNS_MAX_BULK_TARGETS)
+			{
+				too_many = true;
+				break;
+			}
+			namespaces[count++] = ns;
+		}
+	}
+
+	if (!count || !add_or_del)
+	{
+		cmd_faultcode_t fault = (count ? fault_badparams : fault_needmoreparams);
 
 		if (fault == fault_badparams)
 			command_fail(si, fault, STR_INVALID_PARAMS, "CLOAK");
 		else
 			command_fail(si, fault, STR_INSUFFICIENT_PARAMS, "CLOAK");
-		command_fail(si, fault, _("Syntax: CLOAK <project> ADD|DEL <namespace>"));
+		command_fail(si, fault, _("Syntax: CLOAK <project> ADD|DEL <namespace> [<namespace> ...]"));
 		return;
 	}
 
-	// strip trailing "/*" (for simplicity, just strip any trailing sequence of these)
-	// leave the first character alone to ensure we actually have something to add
-	for (size_t i = strlen(namespace) - 1; i > 0; i--)
+	if (too_many)
 	{
-		if (namespace[i] != '/' && namespace[i] != '*')
-			break;
-
-		namespace[i] = '\0';
+		command_fail(si, fault_badparams, _("You may only specify up to %u namespaces at once."), PROJECTNS_MAX_BULK_TARGETS);
+		return;
 	}
 
-	// Only check for new namespaces, in case we have bad entries from a previous configuration
-	// as we wouldn't be able to delete them otherwise
-	if (add_or_del == CLOAKNS_ADD)
+	for (unsigned int i = 0; i < count; i++)
 	{
-		if (strlen(namespace) >= HOSTLEN)
+		char *namespace = namespaces[i];
+
+		// strip trailing "/*" (for simplicity, just strip any trailing sequence of these)
+		// leave the first character alone to ensure we actually have something to add
+		for (size_t j = strlen(namespace) - 1; j > 0; j--)
 		{
-			command_fail(si, fault_badparams, _("The provided cloak namespace is too long."));
-			return;
+			if (namespace[j] != '/' && namespace[j] != '*')
+				break;
+
+			namespace[j] = '\0';
 		}
 
-		for (char *c = namespace; *c; c++)
+		// Only check for new namespaces, in case we have bad entries from a previous configuration
+		// as we wouldn't be able to delete them otherwise
+		if (add_or_del == CLOAKNS_ADD)
 		{
-			if (!isprint(*c))
+			if (strlen(namespace) >= HOSTLEN)
 			{
-				command_fail(si, fault_badparams, _("The provided cloak namespace contains invalid characters."));
+				command_fail(si, fault_badparams, _("The provided cloak namespace is too long."));
 				return;
 			}
+
+			for (char *c = namespace; *c; c++)
+			{
+				if (!isprint(*c))
+				{
+					command_fail(si, fault_badparams, _("The provided cloak namespace contains invalid characters."));
+					return;
+				}
+			}
 		}
 	}
 
@@ -85,54 +113,91 @@ static void cmd_cloak(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	struct projectns *cloak_p = mowgli_patricia_retrieve(projectsvs->projects_by_cloakns, namespace);
-	if (cloak_p && add_or_del == CLOAKNS_ADD)
+	// Validate every namespace before touching anything, so that either all of them
+	// are applied or none are
+	for (unsigned int i = 0; i < count; i++)
 	{
-		command_fail(si, fault_alreadyexists, _("The \2%s\2 namespace already belongs to project \2%s\2."), namespace, cloak_p->name);
-		return;
-	}
-	if (!cloak_p && add_or_del == CLOAKNS_DEL)
-	{
-		command_fail(si, fault_nochange, _("The \2%s\2 namespace is not registered to any project."), namespace);
-		return;
-	}
+		const char *namespace = namespaces[i];
 
-	if (add_or_del == CLOAKNS_DEL)
-	{
-		if (cloak_p != p)
+		for (unsigned int j = 0; j < i; j++)
+		{
+			if (strcasecmp(namespaces[j], namespace) == 0)
+			{
+				command_fail(si, fault_badparams, _("The \2%s\2 namespace was specified more than once."), namespace);
+				return;
+			}
+		}
+
+		struct projectns *cloak_p = mowgli_patricia_retrieve(projectsvs->projects_by_cloakns, namespace);
+		if (cloak_p && add_or_del == CLOAKNS_ADD)
+		{
+			command_fail(si, fault_alreadyexists, _("The \2%s\2 namespace already belongs to project \2%s\2."), namespace, cloak_p->name);
+			return;
+		}
+		if (!cloak_p && add_or_del == CLOAKNS_DEL)
+		{
+			command_fail(si, fault_nochange, _("The \2%s\2 namespace is not registered to any project."), namespace);
+			return;
+		}
+		if (cloak_p && cloak_p != p)
 		{
 			command_fail(si, fault_nosuch_key, _("The \2%s\2 namespace is registered to project \2%s\2, but you tried to remove it from project \2%s\2."), namespace, cloak_p->name, p->name);
 			return;
 		}
+	}
+
+	struct projectns_summary summary = { "", 0, { NULL, NULL, 0 } };
 
-		mowgli_patricia_delete(projectsvs->projects_by_cloakns, namespace);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		const char *namespace = namespaces[i];
 
-		mowgli_node_t *n, *tn;
-		MOWGLI_ITER_FOREACH_SAFE(n, tn, p->cloak_ns.head)
+		if (add_or_del == CLOAKNS_DEL)
 		{
-			const char *ns = n->data;
-			if (irccasecmp(ns, namespace) == 0)
+			mowgli_patricia_delete(projectsvs->projects_by_cloakns, namespace);
+
+			mowgli_node_t *n, *tn;
+			MOWGLI_ITER_FOREACH_SAFE(n, tn, p->cloak_ns.head)
 			{
-				free(n->data);
+				const char *ns = n->data;
+				if (strcasecmp(ns, namespace) == 0)
+				{
+					free(n->data);
 
-				mowgli_node_delete(n, &p->cloak_ns);
-				mowgli_node_free(n);
+					mowgli_node_delete(n, &p->cloak_ns);
+					mowgli_node_free(n);
 
-				break;
+					break;
+				}
 			}
 		}
+		else // CLOAKNS_ADD
+		{
+			/* We've checked above that this namespace isn't already registered */
+			mowgli_patricia_add(projectsvs->projects_by_cloakns, namespace, p);
+			mowgli_node_add(sstrdup(namespace), mowgli_node_create(), &p->cloak_ns);
+		}
 
-		logcommand(si, CMDLOG_ADMIN, "PROJECT:CLOAK:DEL: \2%s\2 from \2%s\2", namespace, p->name);
-		command_success_nodata(si, _("The namespace \2%s\2 was unregistered from project \2%s\2."), namespace, p->name);
+		projectns_summary_add(&summary, namespace);
+	}
+
+	const char *list = projectns_summary_get(&summary);
+
+	if (add_or_del == CLOAKNS_DEL)
+	{
+		projectns_summary_log(&summary, si, "PROJECT:CLOAK:DEL: \2%s\2 from \2%s\2", p->name);
+		if (count == 1)
+			command_success_nodata(si, _("The namespace \2%s\2 was unregistered from project \2%s\2."), list, p->name);
+		else
+			command_success_nodata(si, _("The namespaces \2%s\2 were unregistered from project \2%s\2."), list, p->name);
 	}
 	else // CLOAKNS_ADD
 	{
-		/* We've checked above that this namespace isn't already registered */
-		mowgli_patricia_add(projectsvs->projects_by_cloakns, namespace, p);
-		mowgli_node_add(sstrdup(namespace), mowgli_node_create(), &p->cloak_ns);
-
-		logcommand(si, CMDLOG_ADMIN, "PROJECT:CLOAK:ADD: \2%s\2 to \2%s\2", namespace, p->name);
-		command_success_nodata(si, _("The namespace \2%s\2 was registered to project \2%s\2."), namespace, p->name);
+		projectns_summary_log(&summary, si, "PROJECT:CLOAK:ADD: \2%s\2 to \2%s\2", p->name);
+		if (count == 1)
+			command_success_nodata(si, _("The namespace \2%s\2 was registered to project \2%s\2."), list, p->name);
+		else
+			command_success_nodata(si, _("The namespaces \2%s\2 were registered to project \2%s\2."), list, p->name);
 	}
 }
 
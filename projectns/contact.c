@@ -12,14 +12,13 @@
 
 static void cmd_contact(sourceinfo_t *si, int parc, char *parv[]);
 
-command_t ps_contact = { "CONTACT", N_("Manages project contacts."), PRIV_PROJECT_ADMIN, 5, cmd_contact, { .path = "freenode/project_contact" } };
+command_t ps_contact = { "CONTACT", N_("Manages project contacts."), PRIV_PROJECT_ADMIN, 3, cmd_contact, { .path = "freenode/project_contact" } };
 
 static void cmd_contact(sourceinfo_t *si, int parc, char *parv[])
 {
 	char *project   = parv[0];
 	char *mode      = parv[1];
-	char *target    = parv[2];
-	char **extra    = parv + 3;
+	char *extra     = parv[2];
 
 	enum {
 		CONTACT_BAD = 0,
@@ -40,20 +39,51 @@ static void cmd_contact(sourceinfo_t *si, int parc, char *parv[])
 		GC_SECONDARY,
 	} change_secondary = GC_UNSPEC;
 
+	enum {
+		NOTIFY_UNSPEC = 0,
+		NOTIFY_ON,
+		NOTIFY_OFF,
+	} change_notify = NOTIFY_UNSPEC;
+
 	bool bad_params = false;
+	bool too_many = false;
+
+	char *targets[PROJECTNS_MAX_BULK_TARGETS];
+	unsigned int count = 0;
 
-	for (unsigned char i = 0; extra[i] != NULL; i++)
+	if (extra)
 	{
-		if (strcasecmp(extra[i], "PUBLIC") == 0 && !change_visible)
-			change_visible = VIS_PUBLIC;
-		else if (strcasecmp(extra[i], "PRIVATE") == 0 && !change_visible)
-			change_visible = VIS_PRIVATE;
-		else if (strcasecmp(extra[i], "PRIMARY") == 0 && !change_secondary)
-			change_secondary = GC_PRIMARY;
-		else if (strcasecmp(extra[i], "SECONDARY") == 0 && !change_secondary)
-			change_secondary = GC_SECONDARY;
-		else
-			bad_params = true;
+		// The first word is always an account name; anything after it is either
+		// a setting keyword or another account name.
+		char *saveptr = NULL;
+		for (char *word = strtok_r(extra, " ", &saveptr); word; word = strtok_r(NULL, " ", &saveptr))
+		{
+			bool is_keyword = count > 0 && (strcasecmp(word, "PUBLIC") == 0 || strcasecmp(word, "PRIVATE") == 0 ||
+			                                strcasecmp(word, "PRIMARY") == 0 || strcasecmp(word, "SECONDARY") == 0 ||
+			                                strcasecmp(word, "NOTIFY") == 0 || strcasecmp(word, "NONOTIFY") == 0);
+
+			if (!is_keyword)
+			{
+				if (count == PROJECTNS_MAX_BULK_TARGETS)
+					too_many = true;
+				else
+					targets[count++] = word;
+			}
+			else if (strcasecmp(word, "PUBLIC") == 0 && !change_visible)
+				change_visible = VIS_PUBLIC;
+			else if (strcasecmp(word, "PRIVATE") == 0 && !change_visible)
+				change_visible = VIS_PRIVATE;
+			else if (strcasecmp(word, "PRIMARY") == 0 && !change_secondary)
+				change_secondary = GC_PRIMARY;
+			else if (strcasecmp(word, "SECONDARY") == 0 && !change_secondary)
+				change_secondary = GC_SECONDARY;
+			else if (strcasecmp(word, "NOTIFY") == 0 && !change_notify)
+				change_notify = NOTIFY_ON;
+			else if (strcasecmp(word, "NONOTIFY") == 0 && !change_notify)
+				change_notify = NOTIFY_OFF;
+			else
+				bad_params = true;
+		}
 	}
 
 	if (mode)
@@ -68,12 +98,16 @@ static void cmd_contact(sourceinfo_t *si, int parc, char *parv[])
 			bad_params = true;
 	}
 
-	bool settings_given = change_visible || change_secondary;
+	bool settings_given = change_visible || change_secondary || change_notify;
 
 	if ((add_or_del == CONTACT_DEL && settings_given) || (add_or_del == CONTACT_SET && !settings_given))
 		bad_params = true;
 
-	if (bad_params || !target)
+	// SET reports each change individually, so only allow it for one account at a time
+	if (add_or_del == CONTACT_SET && count > 1)
+		bad_params = true;
+
+	if (bad_params || !count)
 	{
 		cmd_faultcode_t fault = (bad_params ? fault_badparams : fault_needmoreparams);
 
@@ -81,18 +115,40 @@ static void cmd_contact(sourceinfo_t *si, int parc, char *parv[])
 			command_fail(si, fault, STR_INVALID_PARAMS, "CONTACT");
 		else
 			command_fail(si, fault, STR_INSUFFICIENT_PARAMS, "CONTACT");
-		command_fail(si, fault, _("Syntax: CONTACT <project> ADD|DEL|SET <account> [PRIVATE|PUBLIC] [PRIMARY|SECONDARY]"));
+		command_fail(si, fault, _("Syntax: CONTACT <project> ADD|DEL|SET <account> [<account> ...] [PRIVATE|PUBLIC] [PRIMARY|SECONDARY] [NOTIFY|NONOTIFY]"));
 		return;
 	}
 
-	myuser_t *mu = myuser_find_ext(target);
-
-	if (!mu)
+	if (too_many)
 	{
-		command_fail(si, fault_nosuch_target, _("\2%s\2 is not registered."), target);
+		command_fail(si, fault_badparams, _("You may only specify up to %u accounts at once."), PROJECTNS_MAX_BULK_TARGETS);
 		return;
 	}
 
+	myuser_t *users[PROJECTNS_MAX_BULK_TARGETS];
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		users[i] = myuser_find_ext(targets[i]);
+
+		if (!users[i])
+		{
+			command_fail(si, fault_nosuch_target, _("\2%s\2 is not registered."), targets[i]);
+			return;
+		}
+
+		for (unsigned int j = 0; j < i; j++)
+		{
+			if (users[j] == users[i])
+			{
+				command_fail(si, fault_badparams, _("\2%s\2 was specified more than once."), entity(users[i])->name);
+				return;
+			}
+		}
+	}
+
+	myuser_t *mu = users[0];
+
 	struct projectns *p = projectsvs->project_find(project);
 
 	if (!p)
@@ -101,36 +157,95 @@ static void cmd_contact(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
+	// Validate every account before touching anything, so that either all of them
+	// are applied or none are
+	if (add_or_del == CONTACT_ADD || add_or_del == CONTACT_DEL)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			bool is_contact = false;
+
+			mowgli_node_t *n;
+			MOWGLI_ITER_FOREACH(n, p->contacts.head)
+			{
+				struct project_contact *c = n->data;
+				if (c->mu == users[i])
+				{
+					is_contact = true;
+					break;
+				}
+			}
+
+			if (is_contact && add_or_del == CONTACT_ADD)
+			{
+				command_fail(si, fault_nochange, _("\2%s\2 is already listed as contact for project \2%s\2."), entity(users[i])->name, p->name);
+				return;
+			}
+			if (!is_contact && add_or_del == CONTACT_DEL)
+			{
+				command_fail(si, fault_nochange, _("\2%s\2 was not listed as a contact for project \2%s\2."), entity(users[i])->name, p->name);
+				return;
+			}
+		}
+	}
+
+	struct projectns_summary summary = { "", 0, { NULL, NULL, 0 } };
+
+	if (add_or_del == CONTACT_ADD || add_or_del == CONTACT_DEL)
+	{
+		for (unsigned int i = 0; i < count; i++)
+			projectns_summary_add(&summary, entity(users[i])->name);
+	}
+
+	const char *list = projectns_summary_get(&summary);
+
 	if (add_or_del == CONTACT_ADD)
 	{
-		struct project_contact *c = projectsvs->contact_new(p, mu);
-		if (c != NULL)
+		bool visible   = (change_visible == VIS_PUBLIC);
+		bool secondary = (change_secondary == GC_SECONDARY);
+		bool no_notify = (change_notify == NOTIFY_OFF);
+
+		for (unsigned int i = 0; i < count; i++)
 		{
-			if (change_visible == VIS_PUBLIC)
-				c->visible = true;
-			if (change_secondary == GC_SECONDARY)
-				c->secondary = true;
+			/* We've checked above that none of these are contacts yet */
+			struct project_contact *c = projectsvs->contact_new(p, users[i]);
+			c->visible   = visible;
+			c->secondary = secondary;
+			c->no_notify = no_notify;
+		}
 
-			logcommand(si, CMDLOG_ADMIN, "PROJECT:CONTACT:ADD: \2%s\2 to \2%s\2 (%s, %s)", entity(mu)->name, p->name, c->secondary ? "secondary" : "primary", c->visible ? "public" : "private");
+		projectns_summary_log(&summary, si, "PROJECT:CONTACT:ADD: \2%s\2 to \2%s\2 (%s, %s%s)", p->name, secondary ? "secondary" : "primary", visible ? "public" : "private", no_notify ? ", no notifications" : "");
 
-			if (c->secondary)
+		if (count > 1)
+		{
+			if (secondary)
 			{
-				if (c->visible)
-					command_success_nodata(si, _("\2%s\2 was set as a secondary contact for project \2%s\2 (user-visible)."), entity(mu)->name, p->name);
+				if (visible)
+					command_success_nodata(si, _("\2%s\2 were set as secondary contacts for project \2%s\2 (user-visible)."), list, p->name);
 				else
-					command_success_nodata(si, _("\2%s\2 was set as a secondary contact for project \2%s\2 (only visible to staff)."), entity(mu)->name, p->name);
+					command_success_nodata(si, _("\2%s\2 were set as secondary contacts for project \2%s\2 (only visible to staff)."), list, p->name);
 			}
 			else
 			{
-				if (c->visible)
-					command_success_nodata(si, _("\2%s\2 was set as a primary contact for project \2%s\2 (user-visible)."), entity(mu)->name, p->name);
+				if (visible)
+					command_success_nodata(si, _("\2%s\2 were set as primary contacts for project \2%s\2 (user-visible)."), list, p->name);
 				else
-					command_success_nodata(si, _("\2%s\2 was set as a primary contact for project \2%s\2 (only visible to staff)."), entity(mu)->name, p->name);
+					command_success_nodata(si, _("\2%s\2 were set as primary contacts for project \2%s\2 (only visible to staff)."), list, p->name);
 			}
 		}
+		else if (secondary)
+		{
+			if (visible)
+				command_success_nodata(si, _("\2%s\2 was set as a secondary contact for project \2%s\2 (user-visible)."), list, p->name);
+			else
+				command_success_nodata(si, _("\2%s\2 was set as a secondary contact for project \2%s\2 (only visible to staff)."), list, p->name);
+		}
 		else
 		{
-			command_fail(si, fault_nochange, _("\2%s\2 is already listed as contact for project \2%s\2."), entity(mu)->name, p->name);
+			if (visible)
+				command_success_nodata(si, _("\2%s\2 was set as a primary contact for project \2%s\2 (user-visible)."), list, p->name);
+			else
+				command_success_nodata(si, _("\2%s\2 was set as a primary contact for project \2%s\2 (only visible to staff)."), list, p->name);
 		}
 	}
 	else if (add_or_del == CONTACT_SET)
@@ -154,6 +269,8 @@ static void cmd_contact(sourceinfo_t *si, int parc, char *parv[])
 				change_visible = VIS_UNSPEC;
 			if ((c->secondary && change_secondary == GC_SECONDARY) || (!c->secondary && change_secondary == GC_PRIMARY))
 				change_secondary = GC_UNSPEC;
+			if ((!c->no_notify && change_notify == NOTIFY_ON) || (c->no_notify && change_notify == NOTIFY_OFF))
+				change_notify = NOTIFY_UNSPEC;
 
 			if (change_visible == VIS_PUBLIC)
 			{
@@ -180,23 +297,39 @@ static void cmd_contact(sourceinfo_t *si, int parc, char *parv[])
 				command_success_nodata(si, _("\2%s\2 is now considered a primary contact for project \2%s\2."), entity(mu)->name, p->name);
 			}
 
-			if (!change_visible && !change_secondary)
+			if (change_notify == NOTIFY_ON)
+			{
+				c->no_notify = false;
+				logcommand(si, CMDLOG_ADMIN, "PROJECT:CONTACT:SET: \2%s\2 on \2%s\2 to %s", entity(mu)->name, p->name, "notify");
+				command_success_nodata(si, _("\2%s\2 will now be notified of channel registrations in project \2%s\2."), entity(mu)->name, p->name);
+			}
+			else if (change_notify == NOTIFY_OFF)
+			{
+				c->no_notify = true;
+				logcommand(si, CMDLOG_ADMIN, "PROJECT:CONTACT:SET: \2%s\2 on \2%s\2 to %s", entity(mu)->name, p->name, "nonotify");
+				command_success_nodata(si, _("\2%s\2 will no longer be notified of channel registrations in project \2%s\2."), entity(mu)->name, p->name);
+			}
+
+			if (change_visible || change_secondary)
+				projectsvs->contacts_changed(p);
+
+			if (!change_visible && !change_secondary && !change_notify)
 				command_fail(si, fault_nochange, _("Settings for \2%s\2 as a contact for project \2%s\2 were not changed."), entity(mu)->name, p->name);
 		}
 	}
 	else // CONTACT_DEL
 	{
-		if (projectsvs->contact_destroy(p, mu))
-		{
-			logcommand(si, CMDLOG_ADMIN, "PROJECT:CONTACT:DEL: \2%s\2 from \2%s\2", entity(mu)->name, p->name);
-			command_success_nodata(si, _("\2%s\2 was removed as a contact for project \2%s\2."), entity(mu)->name, p->name);
-			if (!p->contacts.count)
-				command_success_nodata(si, _("The project \2%s\2 now has no contacts."), p->name);
-		}
+		/* We've checked above that all of these are contacts */
+		for (unsigned int i = 0; i < count; i++)
+			projectsvs->contact_destroy(p, users[i]);
+
+		projectns_summary_log(&summary, si, "PROJECT:CONTACT:DEL: \2%s\2 from \2%s\2", p->name);
+		if (count > 1)
+			command_success_nodata(si, _("\2%s\2 were removed as contacts for project \2%s\2."), list, p->name);
 		else
-		{
-			command_fail(si, fault_nochange, _("\2%s\2 was not listed as a contact for project \2%s\2."), entity(mu)->name, p->name);
-		}
+			command_success_nodata(si, _("\2%s\2 was removed as a contact for project \2%s\2."), list, p->name);
+		if (!p->contacts.count)
+			command_success_nodata(si, _("The project \2%s\2 now has no contacts."), p->name);
 	}
 }
 
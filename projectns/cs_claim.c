@@ -9,11 +9,28 @@
 #include "fn-compat.h"
 #include "atheme.h"
 #include "projectns.h"
+#include "klinechan.h"
 
 static void cmd_claim(sourceinfo_t *si, int parc, char *parv[]);
 
 command_t cs_claim = { "CLAIM", N_("Grants you access to a channel belonging to your project."), AC_AUTHENTICATED, 2, cmd_claim, { .path = "freenode/cs_claim" } };
 
+// os_klinechan is optional, so its lookup is only used if it happens to be loaded
+static bool is_klinechan(mychan_t *mc)
+{
+	bool (*covers)(const char *name);
+
+	if (privatedata_get(mc, KLINECHAN_PRIVDATA) || metadata_find(mc, "private:klinechan:closer"))
+		return true;
+
+	if (!module_find_published(KLINECHAN_MODULE))
+		return false;
+
+	covers = (bool (*)(const char *)) module_locate_symbol(KLINECHAN_MODULE, "klinechan_covers");
+
+	return covers && covers(mc->name);
+}
+
 static void cmd_claim(sourceinfo_t *si, int parc, char *parv[])
 {
 	char *name = parv[0];
@@ -113,7 +130,7 @@ static void cmd_claim(sourceinfo_t *si, int parc, char *parv[])
 		 * only to get klined; or to lift the klinechan status, allowing
 		 * whatever was meant to get klined to not get klined.
 		 */
-		if (metadata_find(mc, "private:close:closer") || metadata_find(mc, "private:klinechan:closer"))
+		if (metadata_find(mc, "private:close:closer") || is_klinechan(mc))
 		{
 			command_fail(si, fault_noprivs, _("\2%s\2 is closed."), mc->name);
 			return;
@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2026 Libera Chat <https://libera.chat/>
+ * Rights to this code are as documented in doc/LICENSE.
+ *
+ * Services awareness of group registrations
+ * Command to export the project registry to a local file
+ */
+
+#include "fn-compat.h"
+#include "atheme.h"
+#include "projectns.h"
+
+static void cmd_export(sourceinfo_t *si, int parc, char *parv[]);
+
+command_t ps_export = { "EXPORT", N_("Exports the project registry to a file."), PRIV_PROJECT_ADMIN, 1, cmd_export, { .path = "freenode/project_export" } };
+
+enum export_format {
+	EXPORT_BAD = 0,
+	EXPORT_JSON,
+	EXPORT_CSV,
+};
+
+// One line of output. Unused fields are left NULL/0 and omitted from JSON output.
+struct export_row {
+	const char *type;
+	const char *project;
+	const char *name;   // creator, namespace, account or mark setter
+	const char *id;     // entity ID of the contact or mark setter
+	time_t time;
+	unsigned int number;
+	const char *flags;  // space-separated
+	const char *text;   // reginfo or mark text
+};
+
+static char *export_file;
+static char *export_format_name;
+static unsigned int export_interval;
+
+static mowgli_eventloop_timer_t *export_timer;
+static unsigned int export_timer_interval;
+
+static enum export_format parse_format(const char *name)
+{
+	if (!name || strcasecmp(name, "JSON") == 0)
+		return EXPORT_JSON;
+	else if (strcasecmp(name, "CSV") == 0)
+		return EXPORT_CSV;
+
+	return EXPORT_BAD;
+}
+
+// Length of the well-formed UTF-8 sequence at c, or 0 if there is none
+static size_t utf8_seq_len(const unsigned char *c)
+{
+	size_t len;
+	unsigned char min = 0x80, max = 0xBF;
+
+	if (*c < 0x80)
+		return 1;
+	else if (*c >= 0xC2 && *c <= 0xDF)
+		len = 2;
+	else if (*c >= 0xE0 && *c <= 0xEF)
+	{
+		len = 3;
+		if (*c == 0xE0)
+			min = 0xA0;
+		else if (*c == 0xED)
+			max = 0x9F;
+	}
+	else if (*c >= 0xF0 && *c <= 0xF4)
+	{
+		len = 4;
+		if (*c == 0xF0)
+			min = 0x90;
+		else if (*c == 0xF4)
+			max = 0x8F;
+	}
+	else
+		return 0;
+
+	// Only the second byte has a narrower range
+	if (c[1] < min || c[1] > max)
+		return 0;
+	for (size_t i = 2; i < len; i++)
+		if (c[i] < 0x80 || c[i] > 0xBF)
+			return 0;
+
+	return len;
+}
+
+/* Names and texts are not guaranteed to be UTF-8, so bytes that are not part
+ * of a well-formed sequence are escaped as if they were Latin-1, which keeps
+ * the output valid JSON.
+ */
+static void write_json_str(FILE *f, const char *key, const char *value)
+{
+	fprintf(f, ",\"%s\":\"", key);
+
+	for (const unsigned char *c = (const unsigned char *)value; *c; c++)
+	{
+		size_t len;
+
+		if (*c == '"' || *c == '\\')
+			fprintf(f, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else if ((len = utf8_seq_len(c)) == 0)
+			fprintf(f, "\\u%04x", *c);
+		else
+		{
+			fwrite(c, 1, len, f);
+			c += len - 1;
+		}
+	}
+
+	fputc('"', f);
+}
+
+static void write_csv_str(FILE *f, const char *value, bool last)
+{
+	if (value && value[strcspn(value, ",\"\r\n")] != '\0')
+	{
+		fputc('"', f);
+		for (const char *c = value; *c; c++)
+		{
+			if (*c == '"')
+				fputc('"', f);
+			fputc(*c, f);
+		}
+		fputc('"', f);
+	}
+	else if (value)
+	{
+		fputs(value, f);
+	}
+
+	fputc(last ? '\n' : ',', f);
+}
+
+static void write_row(FILE *f, enum export_format format, const struct export_row *row)
+{
+	if (format == EXPORT_JSON)
+	{
+		fprintf(f, "{\"type\":\"%s\"", row->type);
+		write_json_str(f, "project", row->project);
+		if (row->name)
+			write_json_str(f, "name", row->name);
+		if (row->id)
+			write_json_str(f, "id", row->id);
+		if (row->time)
+			fprintf(f, ",\"time\":%lu", (unsigned long)row->time);
+		if (row->number)
+			fprintf(f, ",\"number\":%u", row->number);
+		if (row->flags)
+			write_json_str(f, "flags", row->flags);
+		if (row->text)
+			write_json_str(f, "text", row->text);
+		fputs("}\n", f);
+	}
+	else // EXPORT_CSV
+	{
+		char time[32] = "", number[16] = "";
+
+		if (row->time)
+			snprintf(time, sizeof time, "%lu", (unsigned long)row->time);
+		if (row->number)
+			snprintf(number, sizeof number, "%u", row->number);
+
+		write_csv_str(f, row->type, false);
+		write_csv_str(f, row->project, false);
+		write_csv_str(f, row->name, false);
+		write_csv_str(f, row->id, false);
+		write_csv_str(f, time, false);
+		write_csv_str(f, number, false);
+		write_csv_str(f, row->flags, false);
+		write_csv_str(f, row->text, true);
+	}
+}
+
+// Rows are written out as the registry is walked, so the export never exists in memory as a whole.
+static void write_project(FILE *f, enum export_format format, const struct projectns *p)
+{
+	mowgli_node_t *n;
+
+	struct export_row row = {
+		.type    = "project",
+		.project = p->name,
+		.name    = p->creator,
+		.time    = p->creation_time,
+		.flags   = p->any_may_register ? "open_registration" : NULL,
+		.text    = p->reginfo,
+	};
+	write_row(f, format, &row);
+
+	MOWGLI_ITER_FOREACH(n, p->channel_ns.head)
+	{
+		row = (struct export_row) {
+			.type    = "channel_namespace",
+			.project = p->name,
+			.name    = n->data,
+		};
+		write_row(f, format, &row);
+	}
+
+	MOWGLI_ITER_FOREACH(n, p->cloak_ns.head)
+	{
+		row = (struct export_row) {
+			.type    = "cloak_namespace",
+			.project = p->name,
+			.name    = n->data,
+		};
+		write_row(f, format, &row);
+	}
+
+	MOWGLI_ITER_FOREACH(n, p->contacts.head)
+	{
+		const struct project_contact *contact = n->data;
+		char flags[BUFSIZE] = "";
+
+		if (contact->visible)
+			mowgli_strlcat(flags, " public", sizeof flags);
+		if (contact->secondary)
+			mowgli_strlcat(flags, " secondary", sizeof flags);
+		if (contact->no_notify)
+			mowgli_strlcat(flags, " nonotify", sizeof flags);
+
+		row = (struct export_row) {
+			.type    = "contact",
+			.project = p->name,
+			.name    = entity(contact->mu)->name,
+			.id      = entity(contact->mu)->id,
+			.flags   = flags[0] ? flags + 1 : NULL,
+		};
+		write_row(f, format, &row);
+	}
+
+	MOWGLI_ITER_FOREACH(n, p->marks.head)
+	{
+		const struct project_mark *mark = n->data;
+
+		row = (struct export_row) {
+			.type    = "mark",
+			.project = p->name,
+			.name    = mark->setter_name,
+			.id      = mark->setter_id,
+			.time    = mark->time,
+			.number  = mark->number,
+			.text    = mark->mark,
+		};
+		write_row(f, format, &row);
+	}
+}
+
+// Writes the registry to a temporary file first and renames it into place,
+// so readers never see a partially written export.
+// Returns the number of projects exported, or -1 (with errno set) on failure.
+static int export_projects(const char *filename, enum export_format format)
+{
+	char path[BUFSIZE], tmppath[BUFSIZE];
+
+	if (filename[0] == '/')
+		mowgli_strlcpy(path, filename, sizeof path);
+	else
+		snprintf(path, sizeof path, "%s/%s", DATADIR, filename);
+
+	snprintf(tmppath, sizeof tmppath, "%s.new", path);
+
+	FILE *f = fopen(tmppath, "w");
+	if (!f)
+		return -1;
+
+	if (format == EXPORT_CSV)
+		fputs("type,project,name,id,time,number,flags,text\n", f);
+
+	mowgli_patricia_iteration_state_t state;
+	struct projectns *project;
+	int count = 0;
+
+	MOWGLI_PATRICIA_FOREACH(project, &state, projectsvs->projects)
+	{
+		write_project(f, format, project);
+		count++;
+	}
+
+	int saved_errno = 0;
+
+	if (ferror(f))
+		saved_errno = errno ? errno : EIO;
+	if (fclose(f) != 0 && !saved_errno)
+		saved_errno = errno;
+	if (!saved_errno && rename(tmppath, path) != 0)
+		saved_errno = errno;
+
+	if (saved_errno)
+	{
+		unlink(tmppath);
+		errno = saved_errno;
+		return -1;
+	}
+
+	return count;
+}
+
+static void export_timer_cb(void *unused)
+{
+	int count = export_projects(export_file, parse_format(export_format_name));
+
+	if (count < 0)
+		slog(LG_ERROR, "PROJECT:EXPORT: failed to write \2%s\2: %s", export_file, strerror(errno));
+	else
+		slog(LG_DEBUG, "PROJECT:EXPORT: wrote %d projects to %s", count, export_file);
+}
+
+static void export_schedule(void *unused)
+{
+	if (parse_format(export_format_name) == EXPORT_BAD)
+	{
+		slog(LG_ERROR, "projectns/export: invalid EXPORT_FORMAT \2%s\2, using JSON", export_format_name);
+		free(export_format_name);
+		export_format_name = sstrdup("JSON");
+	}
+
+	if (export_timer && export_timer_interval == export_interval)
+		return;
+
+	if (export_timer)
+		mowgli_timer_destroy(base_eventloop, export_timer);
+
+	export_timer = NULL;
+	export_timer_interval = export_interval;
+
+	if (export_interval)
+		export_timer = mowgli_timer_add(base_eventloop, "projectns_export", export_timer_cb, NULL, export_interval);
+}
+
+static void cmd_export(sourceinfo_t *si, int parc, char *parv[])
+{
+	const char *format_name = parv[0] ? parv[0] : export_format_name;
+	enum export_format format = parse_format(format_name);
+
+	if (!format)
+	{
+		command_fail(si, fault_badparams, STR_INVALID_PARAMS, "EXPORT");
+		command_fail(si, fault_badparams, _("Syntax: EXPORT [JSON|CSV]"));
+		return;
+	}
+
+	int count = export_projects(export_file, format);
+
+	if (count < 0)
+	{
+		command_fail(si, fault_internalerror, _("Could not write the export file: %s"), strerror(errno));
+		slog(LG_ERROR, "PROJECT:EXPORT: failed to write \2%s\2: %s", export_file, strerror(errno));
+		return;
+	}
+
+	logcommand(si, CMDLOG_ADMIN, "PROJECT:EXPORT: \2%d\2 projects to \2%s\2", count, export_file);
+	command_success_nodata(si, ngettext(N_("\2%d\2 project has been exported to \2%s\2."),
+	                                    N_("\2%d\2 projects have been exported to \2%s\2."),
+	                                    count), count, export_file);
+}
+
+static void mod_init(module_t *const restrict m)
+{
+	if (!use_projectns_main_symbols(m))
+		return;
+
+	add_dupstr_conf_item("EXPORT_FILE", &projectsvs->me->conf_table, 0, &export_file, "projects.export");
+	add_dupstr_conf_item("EXPORT_FORMAT", &projectsvs->me->conf_table, 0, &export_format_name, "JSON");
+	add_duration_conf_item("EXPORT_INTERVAL", &projectsvs->me->conf_table, 0, &export_interval, "m", 0);
+
+	hook_add_config_ready(export_schedule);
+
+	service_named_bind_command("projectserv", &ps_export);
+
+	// Pick up the settings immediately if we're loaded at runtime
+	export_schedule(NULL);
+}
+
+static void mod_deinit(const module_unload_intent_t unused)
+{
+	if (export_timer)
+		mowgli_timer_destroy(base_eventloop, export_timer);
+
+	hook_del_config_ready(export_schedule);
+
+	del_conf_item("EXPORT_FILE", &projectsvs->me->conf_table);
+	del_conf_item("EXPORT_FORMAT", &projectsvs->me->conf_table);
+	del_conf_item("EXPORT_INTERVAL", &projectsvs->me->conf_table);
+
+	free(export_file);
+	free(export_format_name);
+
+	service_named_unbind_command("projectserv", &ps_export);
+}
+
+DECLARE_MODULE_V1
+(
+	"freenode/projectns/export", MODULE_UNLOAD_CAPABILITY_OK, mod_init, mod_deinit,
+	"", "freenode <http://www.freenode.net>"
+);
@@ -9,11 +9,98 @@
 #include "fn-compat.h"
 #include "atheme.h"
 #include "projectns.h"
+#include "chanmask.h"
 
 static bool register_require_namespace;
-static char *register_require_namespace_exempt;
 static char *register_project_advice;
 
+static unsigned int register_notify_window;
+
+/* Registration notices waiting to be sent to a group contact, keyed by the
+ * contact's entity ID so that accounts dropped in the meantime are simply skipped.
+ * Registrations by the same account in the same project are grouped together.
+ */
+struct notify_queue {
+	char *contact_id;
+	mowgli_list_t groups;
+};
+
+struct notify_group {
+	char *project;
+	char *namespace;
+	char *nick;
+	char *account;
+	mowgli_list_t channels;
+};
+
+static mowgli_patricia_t *notify_queues;
+static mowgli_eventloop_timer_t *notify_timer;
+
+// Channel names exempt from REGISTER_REQUIRE_NAMESPACE
+static struct chanmask_set *register_exempt;
+// Filled in while the configuration is being read, replaces register_exempt once it is done
+static struct chanmask_set *register_exempt_pending;
+
+static struct chanmask_set *exempt_set_create(void)
+{
+	struct chanmask_set *set = smalloc(sizeof *set);
+
+	chanmask_set_init(set, NULL);
+
+	return set;
+}
+
+static void exempt_set_destroy(struct chanmask_set *set)
+{
+	if (!set)
+		return;
+
+	chanmask_set_clear(set);
+	free(set);
+}
+
+static void exempt_set_add(struct chanmask_set *set, const char *pattern)
+{
+	// Only whether a pattern matches is of interest, so any non-NULL data will do
+	chanmask_set_add(set, pattern, set);
+}
+
+static bool exempt_set_match(const struct chanmask_set *set, const char *name)
+{
+	return set && chanmask_set_match(set, name) != NULL;
+}
+
+// Accepts a single value, which may contain several space-separated patterns, or a block of patterns
+static int c_register_require_namespace_exempt(mowgli_config_file_entry_t *ce)
+{
+	if (!register_exempt_pending)
+		register_exempt_pending = exempt_set_create();
+
+	if (ce->vardata)
+	{
+		char *buf = sstrdup(ce->vardata);
+		char *saveptr = NULL;
+
+		for (char *pattern = strtok_r(buf, " ", &saveptr); pattern; pattern = strtok_r(NULL, " ", &saveptr))
+			exempt_set_add(register_exempt_pending, pattern);
+
+		free(buf);
+	}
+
+	for (mowgli_config_file_entry_t *flce = ce->entries; flce; flce = flce->next)
+		exempt_set_add(register_exempt_pending, flce->varname);
+
+	return 0;
+}
+
+static void exempt_config_ready(void *unused)
+{
+	exempt_set_destroy(register_exempt);
+
+	register_exempt = register_exempt_pending;
+	register_exempt_pending = NULL;
+}
+
 static void userinfo_hook(hook_user_req_t *hdata)
 {
 	bool priv = has_priv(hdata->si, PRIV_PROJECT_AUSPEX);
@@ -126,6 +213,37 @@ static void userinfo_hook(hook_user_req_t *hdata)
 	}
 }
 
+// Emits each line of a rendered contact view with the given prefix, in the user's language
+static void show_contact_view(sourceinfo_t *si, const char *prefix, const char *lines)
+{
+	while (*lines)
+	{
+		size_t len = strcspn(lines, "\n");
+		char buf[BUFSIZE] = "";
+
+		for (const char *c = lines; c < lines + len; )
+		{
+			size_t seglen = strcspn(c, CONTACT_VIEW_SECONDARY "\n");
+			size_t buflen = strlen(buf);
+
+			snprintf(buf + buflen, sizeof buf - buflen, "%.*s", (int)seglen, c);
+			c += seglen;
+
+			if (*c == CONTACT_VIEW_SECONDARY[0])
+			{
+				mowgli_strlcat(buf, _(" (secondary)"), sizeof buf);
+				c++;
+			}
+		}
+
+		command_success_nodata(si, "%s: %s", prefix, buf);
+
+		lines += len;
+		if (*lines)
+			lines++;
+	}
+}
+
 static void chaninfo_hook(hook_channel_req_t *hdata)
 {
 	char *namespace = NULL;
@@ -135,15 +253,19 @@ static void chaninfo_hook(hook_channel_req_t *hdata)
 
 	if (p)
 	{
-		mowgli_node_t *n;
+		// Walk the (short) list of projects the user is a contact for, rather than the project's contacts
 		bool is_gc = false;
-		MOWGLI_ITER_FOREACH(n, p->contacts.head)
+		if (!priv && hdata->si->smu)
 		{
-			struct project_contact *contact = n->data;
-			if (hdata->si->smu == contact->mu)
+			mowgli_node_t *n;
+			MOWGLI_ITER_FOREACH(n, projectsvs->myuser_get_projects(hdata->si->smu)->head)
 			{
-				is_gc = true;
-				break;
+				struct project_contact *contact = n->data;
+				if (contact->project == p)
+				{
+					is_gc = true;
+					break;
+				}
 			}
 		}
 
@@ -153,55 +275,12 @@ static void chaninfo_hook(hook_channel_req_t *hdata)
 		else
 			command_success_nodata(hdata->si, _("The \2%s\2 namespace is registered to the \2%s\2 project"), namespace, p->name);
 
-		char buf[BUFSIZE] = "";
-
-		MOWGLI_ITER_FOREACH(n, p->contacts.head)
-		{
-			struct project_contact *c = n->data;
-			if (!c->visible)
-				continue;
-
-			if (strlen(buf) > 80)
-			{
-				command_success_nodata(hdata->si, _("Group contacts (public): %s"), buf);
-				buf[0] = '\0';
-			}
-			if (buf[0])
-				mowgli_strlcat(buf, ", ", sizeof buf);
-			mowgli_strlcat(buf, entity(c->mu)->name, sizeof buf);
-
-			if (priv && c->secondary)
-				mowgli_strlcat(buf, _(" (secondary)"), sizeof buf);
-		}
-
-		if (buf[0])
-			command_success_nodata(hdata->si, _("Group contacts (public): %s"), buf);
+		show_contact_view(hdata->si, _("Group contacts (public)"),
+			projectsvs->contact_view(p, priv ? CONTACT_VIEW_PUBLIC_STAFF : CONTACT_VIEW_PUBLIC));
 
 		if (priv || is_gc)
-		{
-			buf[0] = '\0';
-			MOWGLI_ITER_FOREACH(n, p->contacts.head)
-			{
-				struct project_contact *c = n->data;
-				if (c->visible)
-					continue;
-
-				if (strlen(buf) > 80)
-				{
-					command_success_nodata(hdata->si, _("Group contacts (private): %s"), buf);
-					buf[0] = '\0';
-				}
-				if (buf[0])
-					mowgli_strlcat(buf, ", ", sizeof buf);
-				mowgli_strlcat(buf, entity(c->mu)->name, sizeof buf);
-
-				if (priv && c->secondary)
-					mowgli_strlcat(buf, _(" (secondary)"), sizeof buf);
-			}
-
-			if (buf[0])
-				command_success_nodata(hdata->si, _("Group contacts (private): %s"), buf);
-		}
+			show_contact_view(hdata->si, _("Group contacts (private)"),
+				projectsvs->contact_view(p, priv ? CONTACT_VIEW_PRIVATE_STAFF : CONTACT_VIEW_PRIVATE));
 	}
 
 	free(namespace);
@@ -212,7 +291,7 @@ static void try_register_hook(hook_channel_register_check_t *hdata)
 	char *namespace = NULL;
 	struct projectns *project = projectsvs->channame_get_project(hdata->name, &namespace);
 
-	if (register_require_namespace && !project && match(register_require_namespace_exempt, hdata->name))
+	if (register_require_namespace && !project && !exempt_set_match(register_exempt, hdata->name))
 	{
 		hdata->approved = 1;
 		command_fail(hdata->si, fault_noprivs, _("The given channel name is not registered to any project, so you cannot use it."));
@@ -245,6 +324,131 @@ static void try_register_hook(hook_channel_register_check_t *hdata)
 	free(namespace);
 }
 
+static void notify_send_group(myuser_t *mu, const struct notify_group *group)
+{
+	if (group->channels.count == 1)
+	{
+		myuser_notice(projectsvs->me->nick, mu, "The user \2%s\2 (account name \2%s\2) has "
+		              "registered the channel \2%s\2 which is within the namespace (\2%s\2) of a "
+		              "project that you are a group contact for (\2%s\2)", group->nick,
+		              group->account, (const char *)group->channels.head->data, group->namespace, group->project);
+		return;
+	}
+
+	myuser_notice(projectsvs->me->nick, mu, "The user \2%s\2 (account name \2%s\2) has "
+	              "registered %zu channels within the namespaces of a project that you are "
+	              "a group contact for (\2%s\2):", group->nick, group->account,
+	              group->channels.count, group->project);
+
+	char buf[BUFSIZE] = "";
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, group->channels.head)
+	{
+		if (strlen(buf) > 80)
+		{
+			myuser_notice(projectsvs->me->nick, mu, "%s", buf);
+			buf[0] = '\0';
+		}
+		if (buf[0])
+			mowgli_strlcat(buf, ", ", sizeof buf);
+		mowgli_strlcat(buf, (const char *)n->data, sizeof buf);
+	}
+
+	if (buf[0])
+		myuser_notice(projectsvs->me->nick, mu, "%s", buf);
+}
+
+static void notify_group_free(struct notify_group *group)
+{
+	mowgli_node_t *n, *tn;
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, group->channels.head)
+	{
+		free(n->data);
+		mowgli_node_delete(n, &group->channels);
+		mowgli_node_free(n);
+	}
+
+	free(group->project);
+	free(group->namespace);
+	free(group->nick);
+	free(group->account);
+	free(group);
+}
+
+static void notify_flush_queue(const char *key, void *data, void *privdata)
+{
+	struct notify_queue *queue = data;
+	myuser_t *mu = myuser_find_uid(queue->contact_id);
+
+	mowgli_node_t *n, *tn;
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, queue->groups.head)
+	{
+		struct notify_group *group = n->data;
+
+		if (mu)
+			notify_send_group(mu, group);
+
+		notify_group_free(group);
+		mowgli_node_delete(n, &queue->groups);
+		mowgli_node_free(n);
+	}
+
+	free(queue->contact_id);
+	free(queue);
+}
+
+static void notify_flush(void *unused)
+{
+	notify_timer = NULL;
+
+	mowgli_patricia_destroy(notify_queues, notify_flush_queue, NULL);
+	notify_queues = mowgli_patricia_create(strcasecanon);
+}
+
+static void notify_enqueue(myuser_t *mu, struct projectns *project, const char *namespace,
+                           const char *nick, const char *account, const char *channel)
+{
+	struct notify_queue *queue = mowgli_patricia_retrieve(notify_queues, entity(mu)->id);
+
+	if (!queue)
+	{
+		queue = smalloc(sizeof *queue);
+		memset(queue, 0, sizeof *queue);
+		queue->contact_id = sstrdup(entity(mu)->id);
+		mowgli_patricia_add(notify_queues, queue->contact_id, queue);
+	}
+
+	struct notify_group *group = NULL;
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, queue->groups.head)
+	{
+		struct notify_group *g = n->data;
+		if (strcmp(g->project, project->name) == 0 && irccasecmp(g->account, account) == 0)
+		{
+			group = g;
+			break;
+		}
+	}
+
+	if (!group)
+	{
+		group = smalloc(sizeof *group);
+		memset(group, 0, sizeof *group);
+		group->project   = sstrdup(project->name);
+		group->namespace = sstrdup(namespace);
+		group->nick      = sstrdup(nick);
+		group->account   = sstrdup(account);
+		mowgli_node_add(group, mowgli_node_create(), &queue->groups);
+	}
+
+	mowgli_node_add(sstrdup(channel), mowgli_node_create(), &group->channels);
+
+	if (!notify_timer)
+		notify_timer = mowgli_timer_add_once(base_eventloop, "projectns_notify", notify_flush, NULL, register_notify_window);
+}
+
 static void did_register_hook(hook_channel_req_t *hdata)
 {
 	char *namespace = NULL;
@@ -257,6 +461,16 @@ static void did_register_hook(hook_channel_req_t *hdata)
 		{
 			const struct project_contact *const contact = n->data;
 
+			if (contact->no_notify)
+				continue;
+
+			if (register_notify_window)
+			{
+				notify_enqueue(contact->mu, project, namespace, hdata->si->su->nick,
+				               entity(hdata->si->smu)->name, hdata->mc->name);
+				continue;
+			}
+
 			myuser_notice(projectsvs->me->nick, contact->mu, "The user \2%s\2 (account name \2%s\2) has "
 			              "registered the channel \2%s\2 which is within the namespace (\2%s\2) of a "
 			              "project that you are a group contact for (\2%s\2)", hdata->si->su->nick,
@@ -283,10 +497,14 @@ static void mod_init(module_t *const restrict m)
 	hook_add_channel_info(chaninfo_hook);
 	hook_add_channel_can_register(try_register_hook);
 	hook_add_channel_register(did_register_hook);
+	hook_add_config_ready(exempt_config_ready);
+
+	notify_queues = mowgli_patricia_create(strcasecanon);
 
 	add_bool_conf_item("REGISTER_REQUIRE_NAMESPACE", &projectsvs->me->conf_table, 0, &register_require_namespace, false);
-	add_dupstr_conf_item("REGISTER_REQUIRE_NAMESPACE_EXEMPT", &projectsvs->me->conf_table, 0, &register_require_namespace_exempt, NULL);
+	add_conf_item("REGISTER_REQUIRE_NAMESPACE_EXEMPT", &projectsvs->me->conf_table, c_register_require_namespace_exempt);
 	add_dupstr_conf_item("REGISTER_PROJECT_ADVICE", &projectsvs->me->conf_table, 0, &register_project_advice, NULL);
+	add_duration_conf_item("REGISTER_NOTIFY_WINDOW", &projectsvs->me->conf_table, 0, &register_notify_window, "s", 0);
 }
 
 static void mod_deinit(const module_unload_intent_t unused)
@@ -295,10 +513,21 @@ static void mod_deinit(const module_unload_intent_t unused)
 	hook_del_channel_info(chaninfo_hook);
 	hook_del_channel_can_register(try_register_hook);
 	hook_del_channel_register(did_register_hook);
+	hook_del_config_ready(exempt_config_ready);
 
 	del_conf_item("REGISTER_REQUIRE_NAMESPACE", &projectsvs->me->conf_table);
 	del_conf_item("REGISTER_REQUIRE_NAMESPACE_EXEMPT", &projectsvs->me->conf_table);
 	del_conf_item("REGISTER_PROJECT_ADVICE", &projectsvs->me->conf_table);
+	del_conf_item("REGISTER_NOTIFY_WINDOW", &projectsvs->me->conf_table);
+
+	// Don't lose any pending notifications
+	if (notify_timer)
+		mowgli_timer_destroy(base_eventloop, notify_timer);
+	notify_timer = NULL;
+	mowgli_patricia_destroy(notify_queues, notify_flush_queue, NULL);
+
+	exempt_set_destroy(register_exempt);
+	exempt_set_destroy(register_exempt_pending);
 }
 
 DECLARE_MODULE_V1
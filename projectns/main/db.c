@@ -87,7 +87,7 @@ static void db_h_contact(database_handle_t *db, const char *type)
 	mowgli_node_add(contact, &contact->myuser_n,  myuser_get_projects(mu));
 	mowgli_node_add(contact, &contact->project_n, &project->contacts);
 
-	unsigned int visible, secondary;
+	unsigned int visible, secondary, no_notify;
 
 	if (db_read_uint(db, &visible))
 		contact->visible = visible;
@@ -98,6 +98,11 @@ static void db_h_contact(database_handle_t *db, const char *type)
 		contact->secondary = secondary;
 	else
 		return;
+
+	if (db_read_uint(db, &no_notify))
+		contact->no_notify = no_notify;
+	else
+		return;
 }
 
 static void db_h_channelns(database_handle_t *db, const char *type)
@@ -167,6 +172,7 @@ static void write_projects_db(database_handle_t *db)
 			db_write_word(db, ((myentity_t*)contact->mu)->name);
 			db_write_uint(db, contact->visible);
 			db_write_uint(db, contact->secondary);
+			db_write_uint(db, contact->no_notify);
 			db_commit_row(db);
 		}
 
@@ -18,6 +18,8 @@ struct projectsvs projectsvs = {
 	.project_destroy = project_destroy,
 	.contact_new = contact_new,
 	.contact_destroy = contact_destroy,
+	.contacts_changed = contacts_changed,
+	.contact_view = contact_view,
 	.show_marks = show_marks,
 	.is_valid_project_name = is_valid_project_name,
 	.myuser_get_projects = myuser_get_projects,
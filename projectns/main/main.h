@@ -29,6 +29,7 @@ void deinit_db(void);
 // objects.c
 struct project_contact *contact_new(struct projectns * const p, myuser_t * const mu);
 bool contact_destroy(struct projectns * const p, myuser_t * const mt);
+void contacts_changed(struct projectns * const p);
 struct projectns *project_new(const char * const name);
 struct projectns *project_find(const char * const name);
 void project_destroy(struct projectns * const p);
@@ -43,6 +44,7 @@ bool persist_load_data(module_t *m);
 bool is_valid_project_name(const char * const name);
 struct projectns *channame_get_project(const char * const name, char **out_namespace);
 mowgli_list_t *myuser_get_projects(myuser_t *mu);
+const char *contact_view(struct projectns * const p, const enum project_contact_view view);
 void show_marks(sourceinfo_t *si, struct projectns *p);
 
 #endif
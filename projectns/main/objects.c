@@ -26,6 +26,7 @@ struct project_contact *contact_new(struct projectns * const p, myuser_t * const
 
 	mowgli_node_add(contact, &contact->myuser_n,  projectsvs.myuser_get_projects(mu));
 	mowgli_node_add(contact, &contact->project_n, &p->contacts);
+	contacts_changed(p);
 	return contact;
 }
 
@@ -42,6 +43,7 @@ bool contact_destroy(struct projectns * const p, myuser_t * const mu)
 			mowgli_node_delete(&contact->myuser_n,  mu_projects);
 			mowgli_node_delete(&contact->project_n, &p->contacts);
 			free(contact);
+			contacts_changed(p);
 			return true;
 		}
 	}
@@ -49,6 +51,16 @@ bool contact_destroy(struct projectns * const p, myuser_t * const mu)
 	return false;
 }
 
+// Must be called whenever a project's contact list or anything shown in it changes
+void contacts_changed(struct projectns * const p)
+{
+	for (unsigned int i = 0; i < CONTACT_VIEW_COUNT; i++)
+	{
+		free(p->contact_views[i]);
+		p->contact_views[i] = NULL;
+	}
+}
+
 struct projectns *project_new(const char * const name)
 {
 	struct projectns *project = smalloc(sizeof *project);
@@ -111,6 +123,8 @@ void project_destroy(struct projectns * const p)
 		mowgli_node_delete(n, &p->marks);
 		mowgli_node_free(n);
 	}
+	contacts_changed(p);
+
 	free(p->name);
 	free(p->reginfo);
 	strshare_unref(p->creator);
@@ -127,6 +141,7 @@ static void userdelete_hook(myuser_t *mu)
 		struct project_contact *contact = n->data;
 		mowgli_node_delete(n, l);
 		mowgli_node_delete(&contact->project_n, &contact->project->contacts);
+		contacts_changed(contact->project);
 
 		slog(LG_REGISTER, _("PROJECT:CONTACT:LOST: \2%s\2 from \2%s\2"), entity(mu)->name, contact->project->name);
 
@@ -136,6 +151,18 @@ static void userdelete_hook(myuser_t *mu)
 	mowgli_list_free(l);
 }
 
+static void userrename_hook(hook_user_rename_t *hdata)
+{
+	mowgli_list_t *l = myuser_get_projects(hdata->mu);
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, l->head)
+	{
+		struct project_contact *contact = n->data;
+		contacts_changed(contact->project);
+	}
+}
+
 void init_structures(void)
 {
 	projectsvs.projects = mowgli_patricia_create(strcasecanon);
@@ -143,6 +170,7 @@ void init_structures(void)
 	projectsvs.projects_by_cloakns = mowgli_patricia_create(strcasecanon);
 
 	hook_add_myuser_delete(userdelete_hook);
+	hook_add_user_rename(userrename_hook);
 }
 
 void deinit_aux_structures(void)
@@ -151,4 +179,5 @@ void deinit_aux_structures(void)
 	mowgli_patricia_destroy(projectsvs.projects_by_cloakns, NULL, NULL);
 
 	hook_del_myuser_delete(userdelete_hook);
+	hook_del_user_rename(userrename_hook);
 }
@@ -86,7 +86,7 @@ bool persist_load_data(module_t *m)
 			mowgli_patricia_add(projectsvs.projects_by_channelns, n->data, new);
 		}
 
-		if (rec->version >= PROJECTNS_MINVER_CONTACT_OBJECT)
+		if (rec->version >= PROJECTNS_MINVER_CONTACT_NOTIFY)
 		{
 			// the list still holds valid objects
 			new->contacts = old_p->contacts;
@@ -98,6 +98,33 @@ bool persist_load_data(module_t *m)
 				// the nodes are still in their proper lists
 			}
 		}
+		else if (rec->version >= PROJECTNS_MINVER_CONTACT_OBJECT)
+		{
+			/* The contact objects are still valid, but were allocated before
+			 * struct project_contact grew. The fields they do have are at the
+			 * same offsets, so copy them over into full-sized objects.
+			 */
+			MOWGLI_ITER_FOREACH_SAFE(n, tn, old_p->contacts.head)
+			{
+				struct project_contact *old_contact = n->data;
+				mowgli_list_t *mu_projects = myuser_get_projects(old_contact->mu);
+
+				mowgli_node_delete(&old_contact->myuser_n,  mu_projects);
+				mowgli_node_delete(&old_contact->project_n, &old_p->contacts);
+
+				struct project_contact *contact = smalloc(sizeof *contact);
+				memset(contact, 0, sizeof *contact);
+				contact->project   = new;
+				contact->mu        = old_contact->mu;
+				contact->visible   = old_contact->visible;
+				contact->secondary = old_contact->secondary;
+
+				mowgli_node_add(contact, &contact->myuser_n,  mu_projects);
+				mowgli_node_add(contact, &contact->project_n, &new->contacts);
+
+				free(old_contact);
+			}
+		}
 		else
 		{
 			MOWGLI_ITER_FOREACH_SAFE(n, tn, old_p->contacts.head)
@@ -132,6 +159,13 @@ bool persist_load_data(module_t *m)
 			new->creation_time = old_p->creation_time;
 		}
 
+		if (rec->version >= PROJECTNS_MINVER_CONTACT_VIEWS)
+		{
+			// cheap enough to re-render, and the view layout may have changed
+			for (unsigned int i = 0; i < CONTACT_VIEW_COUNT; i++)
+				free(old_p->contact_views[i]);
+		}
+
 		/* If you wish to restore anything else, it will not have been there
 		 * in past versions, so you *must* check rec->version to see whether
 		 * the data is present or you *will* cause a crash or worse.
@@ -84,6 +84,50 @@ mowgli_list_t *myuser_get_projects(myuser_t *mu)
 	return l;
 }
 
+// Renders one of the contact lists shown in ChanServ INFO, as newline-separated
+// lines of comma-separated account names. The result is cached on the project
+// until contacts_changed() is called, and shared by all users, so it holds no
+// translated text; secondary contacts are marked with CONTACT_VIEW_SECONDARY.
+const char *contact_view(struct projectns * const p, const enum project_contact_view view)
+{
+	if (p->contact_views[view])
+		return p->contact_views[view];
+
+	const bool visible = (view == CONTACT_VIEW_PUBLIC || view == CONTACT_VIEW_PUBLIC_STAFF);
+	const bool staff   = (view == CONTACT_VIEW_PUBLIC_STAFF || view == CONTACT_VIEW_PRIVATE_STAFF);
+
+	mowgli_string_t *rendered = mowgli_string_create();
+	char buf[BUFSIZE] = "";
+
+	mowgli_node_t *n;
+	MOWGLI_ITER_FOREACH(n, p->contacts.head)
+	{
+		struct project_contact *c = n->data;
+		if (c->visible != visible)
+			continue;
+
+		if (strlen(buf) > 80)
+		{
+			mowgli_string_append(rendered, buf, strlen(buf));
+			mowgli_string_append_char(rendered, '\n');
+			buf[0] = '\0';
+		}
+		if (buf[0])
+			mowgli_strlcat(buf, ", ", sizeof buf);
+		mowgli_strlcat(buf, entity(c->mu)->name, sizeof buf);
+
+		if (staff && c->secondary)
+			mowgli_strlcat(buf, CONTACT_VIEW_SECONDARY, sizeof buf);
+	}
+
+	mowgli_string_append(rendered, buf, strlen(buf));
+
+	p->contact_views[view] = sstrdup(rendered->str ? rendered->str : "");
+	mowgli_string_destroy(rendered);
+
+	return p->contact_views[view];
+}
+
 // TODO: move to projectns/mark?
 void show_marks(sourceinfo_t *si, struct projectns *p)
 {
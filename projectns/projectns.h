@@ -39,4 +39,77 @@ static inline bool use_projectns_main_symbols(module_t *m)
 	return m->mflags != MODFLAG_FAIL;
 }
 
+/*
+ * Comma-separated list of the targets of a bulk command. The reply is kept short
+ * enough to fit on one line along with the rest of it; targets that do not fit are
+ * only counted and summarized at the end. The log gets every target, split across
+ * as many entries as needed.
+ */
+#define PROJECTNS_SUMMARY_LEN 300U
+
+struct projectns_summary
+{
+	char buf[PROJECTNS_SUMMARY_LEN];
+	unsigned int omitted;
+	mowgli_list_t log;	// strings of up to PROJECTNS_SUMMARY_LEN bytes, one per log entry
+};
+
+static inline void projectns_summary_add(struct projectns_summary *s, const char *target)
+{
+	char *line = s->log.tail ? s->log.tail->data : NULL;
+
+	if (!line || strlen(line) + strlen(", ") + strlen(target) >= PROJECTNS_SUMMARY_LEN)
+	{
+		line = smalloc(PROJECTNS_SUMMARY_LEN);
+		mowgli_node_add(line, mowgli_node_create(), &s->log);
+	}
+
+	if (*line)
+		mowgli_strlcat(line, ", ", PROJECTNS_SUMMARY_LEN);
+	mowgli_strlcat(line, target, PROJECTNS_SUMMARY_LEN);
+
+	// Leave room for projectns_summary_get() to add " and N more"
+	const size_t reserve = sizeof " and 4294967295 more";
+	const size_t len = strlen(s->buf);
+
+	if (s->omitted || len + strlen(", ") + strlen(target) >= sizeof s->buf - reserve)
+	{
+		s->omitted++;
+		return;
+	}
+
+	if (len)
+		mowgli_strlcat(s->buf, ", ", sizeof s->buf);
+	mowgli_strlcat(s->buf, target, sizeof s->buf);
+}
+
+static inline const char *projectns_summary_get(struct projectns_summary *s)
+{
+	if (s->omitted)
+	{
+		const size_t len = strlen(s->buf);
+		snprintf(s->buf + len, sizeof s->buf - len, " and %u more", s->omitted);
+		s->omitted = 0;
+	}
+
+	return s->buf;
+}
+
+/*
+ * Logs the command once per string of targets; fmt gets the targets as its
+ * first argument, followed by the rest. Frees the strings as it goes.
+ */
+#define projectns_summary_log(s, si, fmt, ...) \
+	do \
+	{ \
+		mowgli_node_t *n_, *tn_; \
+		MOWGLI_ITER_FOREACH_SAFE(n_, tn_, (s)->log.head) \
+		{ \
+			logcommand((si), CMDLOG_ADMIN, (fmt), (const char *) n_->data, __VA_ARGS__); \
+			free(n_->data); \
+			mowgli_node_delete(n_, &(s)->log); \
+			mowgli_node_free(n_); \
+		} \
+	} while (0)
+
 #endif
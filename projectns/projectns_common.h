@@ -18,11 +18,16 @@
 // Arbitrary number that should avoid truncation even with various protocol overhead
 #define PROJECTNAMELEN CHANNELLEN
 
-#define PROJECTNS_ABIREV 10U
+// Upper bound on the number of namespaces/accounts given to a single CHANNEL, CLOAK or CONTACT command
+#define PROJECTNS_MAX_BULK_TARGETS 32U
+
+#define PROJECTNS_ABIREV 13U
 
 #define PROJECTNS_MINVER_CLOAKNS 4U
 #define PROJECTNS_MINVER_CREATION_MD 9U
 #define PROJECTNS_MINVER_CONTACT_OBJECT 10U
+#define PROJECTNS_MINVER_CONTACT_NOTIFY 11U
+#define PROJECTNS_MINVER_CONTACT_VIEWS 12U
 
 struct project_mark {
 	time_t time;
@@ -32,6 +37,18 @@ struct project_mark {
 	char *setter_name;
 };
 
+// Renderings of a project's contact list as shown in ChanServ INFO
+enum project_contact_view {
+	CONTACT_VIEW_PUBLIC = 0,
+	CONTACT_VIEW_PUBLIC_STAFF,
+	CONTACT_VIEW_PRIVATE,
+	CONTACT_VIEW_PRIVATE_STAFF,
+	CONTACT_VIEW_COUNT,
+};
+
+// Follows secondary contacts in the staff views, which are shared by all users; replaced when shown
+#define CONTACT_VIEW_SECONDARY "\1"
+
 struct projectns {
 	char *name;
 	bool any_may_register;
@@ -42,6 +59,8 @@ struct projectns {
 	mowgli_list_t cloak_ns;
 	time_t creation_time;
 	stringref creator;
+	// newline-separated lines of contacts, rendered on demand; NULL if not rendered yet
+	char *contact_views[CONTACT_VIEW_COUNT];
 };
 
 struct project_contact {
@@ -50,6 +69,8 @@ struct project_contact {
 	struct projectns *project;
 	bool visible;
 	bool secondary;
+	// new fields must go at the end; see persist_load_data()
+	bool no_notify;
 };
 
 struct projectsvs_conf {
@@ -70,6 +91,8 @@ struct projectsvs {
 
 	struct project_contact *(*contact_new)(struct projectns * const p, myuser_t * const mu);
 	bool (*contact_destroy)(struct projectns * const p, myuser_t * const mu);
+	void (*contacts_changed)(struct projectns * const p);
+	const char *(*contact_view)(struct projectns * const p, const enum project_contact_view view);
 
 	void (*show_marks)(sourceinfo_t *si, struct projectns *p);
 	bool (*is_valid_project_name)(const char *name);
@@ -0,0 +1,491 @@
+/*
+ * Compares the default cloak generator in ns_defaultcloak.c with the one it
+ * replaced, over a fixed corpus of account names, and times both.
+ *
+ * This is built on its own, without atheme:
+ *     make cloakcheck
+ *     ./tools/cloakcheck [cases]
+ *
+ * nsdc_build_cloak() and its helpers below are copies of those in
+ * ns_defaultcloak.c, with the default configuration (prefix "user/", digit lead
+ * "-", hash width 5); keep them in sync. old_build_cloak() is the generator as
+ * it was before the table-driven rewrite and must not be changed. It uses the
+ * <ctype.h> classes, so only the C locale is compared. For names too long to fit,
+ * it wrote one byte past the end of the buffer and could leave the cloak
+ * unterminated; it is given room for that here, and such cloaks are compared
+ * only up to HOSTLEN characters.
+ *
+ * Exits with status 1 if any cloak differs.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#define HOSTLEN             63
+#define CLOAK_PREFIX        "user/"
+#define CLOAK_PREFIX_LEN    strlen(CLOAK_PREFIX)
+
+#define NSDC_CH_DIGIT       0x01U
+#define NSDC_CH_ALPHA       0x02U
+#define NSDC_CH_DASH        0x04U
+#define NSDC_CH_UNDERSCORE  0x08U
+#define NSDC_CH_INVALID     0x10U
+
+// Names generated in addition to the fixed ones below, by default
+#define CLOAKCHECK_CASES    1000000UL
+
+// Timed passes over the corpus, per generator
+#define CLOAKCHECK_ROUNDS   5U
+
+// Account names that have caught out cloak generators before
+static const char *const cloakcheck_fixed[] = {
+	"", "-", "_", "--", "__", "-_-", "1", "-1", "1abc", "123", "1-2", "a--b", "a--b_", "a-_-b", "9-",
+	"foo", "Foo_Bar", "x|y", "[away]", "{}^~", "a.b", "a b", "\xe9t\xe9", "\x80\xff",
+	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa--------------------_x",
+	"1111111111111111111111111111111111111111111111111111111111111111111111111111",
+	"a---------------------------------------------------------------------------_",
+	NULL
+};
+
+// Characters the generated names are made of, weighted towards the interesting ones
+static const char cloakcheck_alphabet[] = "abcXYZ019-_-|[]{}^`.\\~\xe9\x80 aZ5";
+
+static unsigned char ToUpperTab[256];
+#define ToUpper(c) (ToUpperTab[(unsigned char) (c)])
+
+static const char *const nsdc_digit_lead = "-";
+static const unsigned int nsdc_hash_width = 5;
+static uint32_t hash_iv = 0;
+
+static struct
+{
+	unsigned char   fold;
+	unsigned char   flags;
+} nsdc_chartab[256];
+
+// atheme's mowgli_strlcpy()
+static size_t
+mowgli_strlcpy(char *const restrict dest, const char *const restrict src, const size_t size)
+{
+	const size_t len = strlen(src);
+
+	if (size)
+	{
+		const size_t n = (len >= size) ? size - 1 : len;
+
+		(void) memcpy(dest, src, n);
+		dest[n] = '\0';
+	}
+
+	return len;
+}
+
+// The RFC1459 casemapping that atheme's ToUpper() uses
+static void
+cloakcheck_init_toupper(void)
+{
+	for (unsigned int b = 0; b < 256; b++)
+	{
+		unsigned int c = b;
+
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		else if (c == '{')
+			c = '[';
+		else if (c == '}')
+			c = ']';
+		else if (c == '|')
+			c = '\\';
+		else if (c == '~')
+			c = '^';
+
+		ToUpperTab[b] = (unsigned char) c;
+	}
+
+	// FNV-0 to calculate an offset that isn't the default one
+	for (const char *p = CLOAK_PREFIX; *p != '\0'; p++)
+	{
+		hash_iv ^= (uint32_t) *p;
+		hash_iv *= 16777619;
+	}
+}
+
+static bool
+old_build_cloak(const char *const restrict accname, char *const restrict newhost, const size_t hostlen)
+{
+	size_t i = (CLOAK_PREFIX_LEN - 1);
+	bool invalidchar = false;
+	uint32_t hash = hash_iv;
+
+	(void) mowgli_strlcpy(newhost, CLOAK_PREFIX, hostlen);
+
+	// Search for invalid characters. This changes copying behavior
+	for (const char *p = accname; *p != '\0'; p++)
+	{
+		if (*p == '-')
+			continue;
+
+		if (isalnum((unsigned char) *p))
+			continue;
+
+		invalidchar = true;
+		break;
+	}
+
+	// Copy the cloak and calculate the hash from casefolded characters
+	for (const char *p = accname; *p != '\0'; p++)
+	{
+		const int c = ToUpper((unsigned char) *p);
+
+		hash ^= (uint32_t) c;
+		hash *= 16777619;
+
+		if (i >= (hostlen - 1))
+			continue;
+
+		if (isdigit(c))
+		{
+			if (i == (CLOAK_PREFIX_LEN - 1))
+				newhost[++i] = '-';
+
+			newhost[++i] = *p;
+		}
+		else if (isalpha(c))
+		{
+			newhost[++i] = *p;
+		}
+		else if (c == '-')
+		{
+			if ((! invalidchar) || (newhost[i] != '-'))
+				newhost[++i] = '-';
+		}
+		else if (c == '_')
+		{
+			if (newhost[i] != '-')
+				newhost[++i] = '-';
+		}
+	}
+
+	// Bump i to denote the number of bytes written
+	i++;
+
+	if (i == CLOAK_PREFIX_LEN)
+	{
+		// Yes, you're very clever. Have an easter egg
+		(void) mowgli_strlcpy(newhost + i, "...", hostlen - i);
+
+		i += 3;
+	}
+
+	if (invalidchar)
+	{
+		// Fold hash value to fit in 5 digits
+		hash = (hash >> 17) + (hash & 0xFFFF);
+
+		(void) snprintf(newhost + i, hostlen - i, ":%05" PRIu32, hash);
+	}
+	else
+		newhost[i] = '\0';
+
+	return invalidchar;
+}
+
+static void
+nsdc_init_chartab(void)
+{
+	for (unsigned int b = 0; b < 256; b++)
+	{
+		const unsigned char c = (unsigned char) ToUpper(b);
+		unsigned char flags = 0;
+
+		// Deliberately not isalnum() and friends, so cloaks do not depend on the locale
+		if (c >= '0' && c <= '9')
+			flags |= NSDC_CH_DIGIT;
+		else if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+			flags |= NSDC_CH_ALPHA;
+		else if (c == '-')
+			flags |= NSDC_CH_DASH;
+		else if (c == '_')
+			flags |= NSDC_CH_UNDERSCORE;
+
+		if (! ((b >= '0' && b <= '9') || (b >= 'A' && b <= 'Z') || (b >= 'a' && b <= 'z') || b == '-'))
+			flags |= NSDC_CH_INVALID;
+
+		nsdc_chartab[b].fold = c;
+		nsdc_chartab[b].flags = flags;
+	}
+}
+
+static inline bool
+nsdc_emit(char *const restrict newhost, size_t *const restrict len, const size_t hostlen, const size_t prefixlen,
+          const unsigned char ch, const unsigned char flags, const bool invalidchar, size_t *const restrict leadend)
+{
+	if (*len >= (hostlen - 1))
+		return false;
+
+	if (flags & NSDC_CH_DIGIT)
+	{
+		// Cloaks must not look like IP addresses
+		if (*len == prefixlen)
+		{
+			if (*len + 1 >= (hostlen - 1))
+				return false;
+
+			newhost[(*len)++] = nsdc_digit_lead[0];
+			*leadend = *len;
+		}
+
+		newhost[(*len)++] = (char) ch;
+	}
+	else if (flags & NSDC_CH_ALPHA)
+	{
+		newhost[(*len)++] = (char) ch;
+	}
+	else if (flags & NSDC_CH_DASH)
+	{
+		if ((! invalidchar) || (newhost[*len - 1] != '-'))
+			newhost[(*len)++] = '-';
+	}
+	else if (flags & NSDC_CH_UNDERSCORE)
+	{
+		if (newhost[*len - 1] != '-')
+			newhost[(*len)++] = '-';
+	}
+
+	return true;
+}
+
+static size_t
+nsdc_collapse_dashes(char *const restrict newhost, const size_t len, const size_t prefixlen, const size_t leadend)
+{
+	size_t out = prefixlen;
+
+	for (size_t in = prefixlen; in < len; in++)
+	{
+		if (newhost[in] == '-' && newhost[out - 1] == '-' && in >= leadend)
+			continue;
+
+		newhost[out++] = newhost[in];
+	}
+
+	return out;
+}
+
+static bool
+nsdc_build_cloak_as(const char *const restrict prefix, const uint32_t iv, const char *const restrict accname,
+                    char *const restrict newhost, const size_t hostlen)
+{
+	const size_t prefixlen = strlen(prefix);
+	size_t len = prefixlen;
+	size_t leadend = 0;
+	bool invalidchar = false;
+	bool truncated = false;
+	uint32_t hash = iv;
+
+	(void) mowgli_strlcpy(newhost, prefix, hostlen);
+
+	// Copy the cloak and calculate the hash from casefolded characters, in one pass
+	for (const unsigned char *p = (const unsigned char *) accname; *p != '\0'; p++)
+	{
+		const unsigned char flags = nsdc_chartab[*p].flags;
+
+		hash ^= (uint32_t) nsdc_chartab[*p].fold;
+		hash *= 16777619;
+
+		if ((flags & NSDC_CH_INVALID) && ! invalidchar)
+		{
+			// This changes copying behavior, including for what we have copied so far
+			invalidchar = true;
+			len = nsdc_collapse_dashes(newhost, len, prefixlen, leadend);
+		}
+
+		if (! truncated && ! nsdc_emit(newhost, &len, hostlen, prefixlen, *p, flags, invalidchar, &leadend))
+			truncated = true;
+	}
+
+	if (truncated && invalidchar)
+	{
+		// Collapsing may have made room for characters we dropped; only happens for overlong names
+		len = prefixlen;
+		leadend = 0;
+
+		for (const unsigned char *p = (const unsigned char *) accname; *p != '\0'; p++)
+			if (! nsdc_emit(newhost, &len, hostlen, prefixlen, *p, nsdc_chartab[*p].flags, true, &leadend))
+				break;
+	}
+
+	if (len == prefixlen)
+	{
+		// Yes, you're very clever. Have an easter egg
+		(void) mowgli_strlcpy(newhost + len, "...", hostlen - len);
+
+		len = strlen(newhost);
+	}
+
+	if (invalidchar)
+	{
+		if (nsdc_hash_width == 5)
+		{
+			// Fold hash value to fit in 5 digits
+			hash = (hash >> 17) + (hash & 0xFFFF);
+		}
+		else
+		{
+			uint32_t limit = 1;
+
+			for (unsigned int n = 0; n < nsdc_hash_width; n++)
+				limit *= 10;
+
+			hash %= limit;
+		}
+
+		(void) snprintf(newhost + len, hostlen - len, ":%0*" PRIu32, (int) nsdc_hash_width, hash);
+	}
+	else
+		newhost[len] = '\0';
+
+	return invalidchar;
+}
+
+static bool
+nsdc_build_cloak(const char *const restrict accname, char *const restrict newhost, const size_t hostlen)
+{
+	return nsdc_build_cloak_as(CLOAK_PREFIX, hash_iv, accname, newhost, hostlen);
+}
+
+// xorshift32, so that the corpus is the same on every run and platform
+static uint32_t
+cloakcheck_random(uint32_t *const restrict state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return (*state = x);
+}
+
+// The fixed names followed by the generated ones
+static char **
+cloakcheck_corpus(const unsigned long cases, size_t *const restrict count)
+{
+	size_t fixed = 0;
+
+	while (cloakcheck_fixed[fixed])
+		fixed++;
+
+	char **const names = calloc(fixed + cases, sizeof *names);
+	uint32_t state = 0x6E736463U;
+
+	if (! names)
+		return NULL;
+
+	for (size_t i = 0; i < fixed; i++)
+		names[i] = strdup(cloakcheck_fixed[i]);
+
+	for (unsigned long i = 0; i < cases; i++)
+	{
+		// Mostly short names, with every tenth long enough to be truncated
+		const size_t len = cloakcheck_random(&state) % ((i % 10 == 0) ? 80 : 16);
+		char *const name = malloc(len + 1);
+
+		if (! name)
+			return NULL;
+
+		for (size_t j = 0; j < len; j++)
+			name[j] = cloakcheck_alphabet[cloakcheck_random(&state) % (sizeof cloakcheck_alphabet - 1)];
+
+		name[len] = '\0';
+		names[fixed + i] = name;
+	}
+
+	*count = fixed + cases;
+	return names;
+}
+
+static double
+cloakcheck_time(bool (*const build)(const char *, char *, size_t), char **const names, const size_t count)
+{
+	char newhost[HOSTLEN + 2];
+	struct timespec start, end;
+	unsigned long sink = 0;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (unsigned int round = 0; round < CLOAKCHECK_ROUNDS; round++)
+		for (size_t i = 0; i < count; i++)
+			sink += build(names[i], newhost, HOSTLEN + 1) + (unsigned char) newhost[CLOAK_PREFIX_LEN];
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// Keeps the calls from being optimised away
+	if (sink == 1)
+		(void) putchar('\0');
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double) count * CLOAKCHECK_ROUNDS);
+}
+
+int
+main(const int argc, char **const argv)
+{
+	const unsigned long cases = (argc > 1) ? strtoul(argv[1], NULL, 10) : CLOAKCHECK_CASES;
+	char oldhost[HOSTLEN + 2], newhost[HOSTLEN + 1];
+	unsigned long diffs = 0;
+	unsigned long overruns = 0;
+	size_t count;
+
+	(void) cloakcheck_init_toupper();
+	(void) nsdc_init_chartab();
+
+	char **const names = cloakcheck_corpus(cases, &count);
+
+	if (! names)
+	{
+		(void) fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 2;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		(void) memset(oldhost, 0, sizeof oldhost);
+
+		const bool oldtype = old_build_cloak(names[i], oldhost, HOSTLEN + 1);
+		const bool newtype = nsdc_build_cloak(names[i], newhost, sizeof newhost);
+
+		if (strlen(oldhost) > HOSTLEN)
+		{
+			overruns++;
+			oldhost[HOSTLEN] = '\0';
+		}
+
+		if (oldtype == newtype && strcmp(oldhost, newhost) == 0)
+			continue;
+
+		if (diffs++ < 20)
+			(void) printf("DIFF [%s]: old %s (%d), new %s (%d)\n", names[i], oldhost, oldtype, newhost,
+			              newtype);
+	}
+
+	(void) printf("%zu names, %lu differences (%lu overlong, where the old generator overran its buffer)\n",
+	              count, diffs, overruns);
+
+	const double oldns = cloakcheck_time(&old_build_cloak, names, count);
+	const double newns = cloakcheck_time(&nsdc_build_cloak, names, count);
+
+	(void) printf("old: %.1f ns per cloak\nnew: %.1f ns per cloak\n", oldns, newns);
+
+	for (size_t i = 0; i < count; i++)
+		(void) free(names[i]);
+
+	(void) free(names);
+
+	return (diffs != 0);
+}